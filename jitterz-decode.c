@@ -0,0 +1,354 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * jitterz-decode
+ *
+ * Reads a jitterz --stall-file and prints the buckets, percentiles and
+ * a time series of the stalls of any part of the run, with any
+ * threshold above the recorded one, without running the test again.
+ *
+ * Copyright 2019-2020 Tom Rix <trix@redhat.com>
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <time.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "jitterz.h"
+
+#define NSEC_PER_SEC 1000000000
+#define NUMBER_BUCKETS JITTERZ_BUCKETS
+
+static const double percentiles[] = { 50, 99, 99.9, 99.99 };
+#define NUMBER_PERCENTILES (sizeof(percentiles) / sizeof(percentiles[0]))
+
+static double from_sec; /* --from */
+static double to_sec = -1; /* --to, -1 is the end of the file */
+static uint64_t threshold_ns; /* --threshold, 0 is the recorded one */
+static int only_cpu = -1; /* --cpu */
+static double series_sec; /* --series, 0 is off */
+
+/* What one cpu of the file had in the window */
+struct cpu_stalls {
+	int cpu;
+	uint64_t count;
+	uint64_t lost_ticks;
+	uint64_t buckets[NUMBER_BUCKETS];
+	uint64_t *ticks; /* every stall, for the percentiles */
+};
+
+static inline void display_help(int error)
+{
+	printf("jitterz-decode\n");
+	printf("Usage:\n"
+	       "jitterz-decode <options> FILE\n\n"
+	       "         --from=SEC        only stalls from SEC after the start of the test\n"
+	       "         --to=SEC          only stalls before SEC after the start of the test\n"
+	       "         --threshold=USEC  only stalls of USEC or more, at least what was\n"
+	       "                           recorded\n"
+	       "-c NUM   --cpu=NUM         only the stalls of cpu NUM\n"
+	       "         --series=SEC      also print the stalls and lost time of every\n"
+	       "                           SEC seconds\n"
+	       "-h       --help            display usage\n");
+	if (error)
+		exit(EXIT_FAILURE);
+	exit(EXIT_SUCCESS);
+}
+
+enum option_values {
+	OPT_FROM = 1,
+	OPT_TO,
+	OPT_THRESHOLD,
+	OPT_CPU,
+	OPT_SERIES,
+	OPT_HELP,
+};
+
+static void process_options(int argc, char *argv[])
+{
+	for (;;) {
+		int option_index = 0;
+		static struct option long_options[] = {
+			{ "from", required_argument, NULL, OPT_FROM },
+			{ "to", required_argument, NULL, OPT_TO },
+			{ "threshold", required_argument, NULL, OPT_THRESHOLD },
+			{ "cpu", required_argument, NULL, OPT_CPU },
+			{ "series", required_argument, NULL, OPT_SERIES },
+			{ "help", no_argument, NULL, OPT_HELP },
+			{ NULL, 0, NULL, 0 },
+		};
+		int c = getopt_long(argc, argv, "c:h", long_options,
+				    &option_index);
+		if (c == -1)
+			break;
+		switch (c) {
+		case OPT_FROM:
+			from_sec = atof(optarg);
+			break;
+		case OPT_TO:
+			to_sec = atof(optarg);
+			break;
+		case OPT_THRESHOLD:
+			threshold_ns = atof(optarg) * 1000;
+			break;
+		case 'c':
+		case OPT_CPU:
+			only_cpu = atoi(optarg);
+			break;
+		case OPT_SERIES:
+			series_sec = atof(optarg);
+			break;
+		case 'h':
+		case OPT_HELP:
+			display_help(0);
+			break;
+		default:
+			display_help(1);
+		}
+	}
+	if (optind != argc - 1)
+		display_help(1);
+}
+
+/* Map the file and check it is a stall file, exits if it is not */
+static const struct jitterz_stall_file_header *map_stall_file(const char *path,
+							      size_t *size)
+{
+	const struct jitterz_stall_file_header *h;
+	struct stat st;
+	int fd = open(path, O_RDONLY);
+
+	if (fd < 0 || fstat(fd, &st)) {
+		fprintf(stderr, "Could not open %s: %s\n", path,
+			strerror(errno));
+		exit(1);
+	}
+	if ((size_t)st.st_size < sizeof(*h)) {
+		fprintf(stderr, "%s is not a jitterz stall file\n", path);
+		exit(1);
+	}
+	h = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (h == MAP_FAILED) {
+		fprintf(stderr, "Could not map %s: %s\n", path,
+			strerror(errno));
+		exit(1);
+	}
+	if (memcmp(h->magic, JITTERZ_STALL_FILE_MAGIC, sizeof(h->magic)) ||
+	    h->version != JITTERZ_STALL_FILE_VERSION ||
+	    h->records_offset > st.st_size || !h->frequency ||
+	    h->nr_cpus <= 0 ||
+	    sizeof(*h) + h->nr_cpus * sizeof(h->cpus[0]) > h->records_offset) {
+		fprintf(stderr, "%s is not a jitterz stall file\n", path);
+		exit(1);
+	}
+	*size = st.st_size;
+	return h;
+}
+
+static int compare_ticks(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y ? 1 : 0;
+}
+
+/* Same buckets as jitterz: [min << i, min << (i + 1)), the last open */
+static int bucket_index(uint64_t ticks, uint64_t tick_min)
+{
+	int i = 0;
+
+	while (i < NUMBER_BUCKETS - 1 && ticks >= tick_min << (i + 1))
+		i++;
+	return i;
+}
+
+/* The cpu of a record, NULL if the file has no such cpu */
+static struct cpu_stalls *find_cpu(struct cpu_stalls *cpus, int nr_cpus,
+				   int cpu)
+{
+	int n;
+
+	for (n = 0; n < nr_cpus; n++)
+		if (cpus[n].cpu == cpu)
+			return &cpus[n];
+	return NULL;
+}
+
+/* CLOCK_REALTIME nsec as UTC, e.g. 2020-04-01T12:00:00.000123456Z */
+static void format_realtime(uint64_t ns, char *buf, size_t len)
+{
+	time_t sec = ns / NSEC_PER_SEC;
+	struct tm tm;
+	size_t n;
+
+	gmtime_r(&sec, &tm);
+	n = strftime(buf, len, "%Y-%m-%dT%H:%M:%S", &tm);
+	snprintf(buf + n, len - n, ".%09" PRIu64 "Z", ns % NSEC_PER_SEC);
+}
+
+int main(int argc, char **argv)
+{
+	const struct jitterz_stall_file_header *h;
+	const struct jitterz_stall_file_record *rec;
+	struct cpu_stalls *cpus;
+	uint64_t nr_records, i, tick_min, base, from, to, end = 0;
+	uint64_t *series_count = NULL, *series_lost = NULL, nr_series = 0;
+	uint64_t series_ticks = 0;
+	double ns_per_tick;
+	size_t size;
+	int n, k;
+
+	process_options(argc, argv);
+	h = map_stall_file(argv[optind], &size);
+	rec = (const void *)((const char *)h + h->records_offset);
+	/* a partial record at the end of a file cut short is left out */
+	nr_records = (size - h->records_offset) / sizeof(*rec);
+	ns_per_tick = 1e9 / h->frequency;
+
+	if (threshold_ns < h->threshold_ns)
+		threshold_ns = h->threshold_ns;
+	tick_min = threshold_ns * h->frequency / NSEC_PER_SEC;
+	if (!tick_min)
+		tick_min = 1;
+	/* ticks are relative to the start of the test */
+	base = h->anchor_tick ? h->anchor_tick : nr_records ? rec[0].start_tick : 0;
+	for (i = 0; i < nr_records; i++)
+		if (rec[i].start_tick + rec[i].ticks > end)
+			end = rec[i].start_tick + rec[i].ticks;
+	from = base + from_sec * h->frequency;
+	to = to_sec < 0 ? end : base + to_sec * h->frequency;
+
+	cpus = calloc(h->nr_cpus, sizeof(*cpus));
+	if (!cpus) {
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+	for (n = 0; n < h->nr_cpus; n++)
+		cpus[n].cpu = h->cpus[n];
+	/* count first, the ticks of a cpu only get room for its own stalls */
+	for (i = 0; i < nr_records; i++) {
+		const struct jitterz_stall_file_record *r = &rec[i];
+		struct cpu_stalls *c;
+
+		if (r->start_tick < from || r->start_tick >= to ||
+		    r->ticks < tick_min ||
+		    (only_cpu >= 0 && r->cpu != only_cpu))
+			continue;
+		c = find_cpu(cpus, h->nr_cpus, r->cpu);
+		if (c)
+			c->count++;
+	}
+	for (n = 0; n < h->nr_cpus; n++) {
+		cpus[n].ticks = malloc((cpus[n].count + 1) * sizeof(uint64_t));
+		if (!cpus[n].ticks) {
+			fprintf(stderr, "Out of memory\n");
+			exit(1);
+		}
+		cpus[n].count = 0;
+	}
+	if (series_sec > 0 && to > from) {
+		series_ticks = series_sec * h->frequency;
+		if (!series_ticks)
+			series_ticks = 1;
+		nr_series = (to - from + series_ticks - 1) / series_ticks;
+		series_count = calloc(nr_series, sizeof(*series_count));
+		series_lost = calloc(nr_series, sizeof(*series_lost));
+		if (!series_count || !series_lost) {
+			fprintf(stderr, "Out of memory\n");
+			exit(1);
+		}
+	}
+
+	for (i = 0; i < nr_records; i++) {
+		const struct jitterz_stall_file_record *r = &rec[i];
+		struct cpu_stalls *c;
+
+		if (r->start_tick < from || r->start_tick >= to ||
+		    r->ticks < tick_min ||
+		    (only_cpu >= 0 && r->cpu != only_cpu))
+			continue;
+		c = find_cpu(cpus, h->nr_cpus, r->cpu);
+		if (!c)
+			continue;
+		c->ticks[c->count++] = r->ticks;
+		c->lost_ticks += r->ticks;
+		c->buckets[bucket_index(r->ticks, tick_min)]++;
+		if (nr_series) {
+			uint64_t s = (r->start_tick - from) / series_ticks;
+
+			series_count[s]++;
+			series_lost[s] += r->ticks;
+		}
+	}
+
+	fprintf(stdout, "clock : %.16s\n", h->clock);
+	fprintf(stdout, "frequency : %" PRIu64 " ticks/sec\n", h->frequency);
+	if (h->anchor_tick) {
+		char when[64];
+
+		format_realtime(h->anchor_realtime_ns, when, sizeof(when));
+		fprintf(stdout, "test start : %s\n", when);
+	}
+	fprintf(stdout, "window : %.3f - %.3f sec\n",
+		((int64_t)(from - base)) * ns_per_tick / 1e9,
+		((int64_t)(to - base)) * ns_per_tick / 1e9);
+	fprintf(stdout, "cutoff time (usec) : stall count \n");
+	fprintf(stdout, "cpu               :");
+	for (n = 0; n < h->nr_cpus; n++)
+		fprintf(stdout, " %d", cpus[n].cpu);
+	fprintf(stdout, "\n");
+	for (k = 0; k < NUMBER_BUCKETS; k++) {
+		fprintf(stdout, "%.1f :", (threshold_ns << k) / 1000.);
+		for (n = 0; n < h->nr_cpus; n++)
+			fprintf(stdout, " %" PRIu64, cpus[n].buckets[k]);
+		fprintf(stdout, "\n");
+	}
+	fprintf(stdout, "stalls :");
+	for (n = 0; n < h->nr_cpus; n++)
+		fprintf(stdout, " %" PRIu64, cpus[n].count);
+	fprintf(stdout, "\nlost time (sec) :");
+	for (n = 0; n < h->nr_cpus; n++)
+		fprintf(stdout, " %f", cpus[n].lost_ticks * ns_per_tick / 1e9);
+	fprintf(stdout, "\n");
+
+	fprintf(stdout, "stall percentiles (usec)\n");
+	for (n = 0; n < h->nr_cpus; n++)
+		qsort(cpus[n].ticks, cpus[n].count, sizeof(uint64_t),
+		      compare_ticks);
+	for (k = 0; k <= (int)NUMBER_PERCENTILES; k++) {
+		if (k < (int)NUMBER_PERCENTILES)
+			fprintf(stdout, "p%g :", percentiles[k]);
+		else
+			fprintf(stdout, "max :");
+		for (n = 0; n < h->nr_cpus; n++) {
+			struct cpu_stalls *c = &cpus[n];
+			uint64_t at = c->count;
+
+			if (k < (int)NUMBER_PERCENTILES)
+				at = (uint64_t)(percentiles[k] / 100 * c->count +
+						0.999999);
+			fprintf(stdout, " %.3f",
+				at ? c->ticks[at - 1] * ns_per_tick / 1e3 : 0.);
+		}
+		fprintf(stdout, "\n");
+	}
+
+	if (nr_series) {
+		fprintf(stdout, "time series (sec : stalls : lost usec)\n");
+		for (i = 0; i < nr_series; i++)
+			fprintf(stdout, "%.3f : %" PRIu64 " : %.3f\n",
+				((int64_t)(from - base) + i * series_ticks) *
+					ns_per_tick / 1e9,
+				series_count[i], series_lost[i] * ns_per_tick / 1e3);
+	}
+	return 0;
+}
@@ -25,146 +25,150 @@
 #include <sys/stat.h>
 #include <sys/mman.h>
 #include <math.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <ctype.h>
+#include <stdarg.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include "jitterz.h"
+#include "jitterz_internal.h"
 
 #define CPU_DEFAULT 0
 static int cpu;
+static int *cpu_list; /* --cpus, otherwise just cpu */
+static int num_cpus;
 static int clocksel;
-static int policy = SCHED_FIFO;
-static int priority = 5;
+static struct jitterz_config config; /* everything libjitterz measures by */
+static struct jitterz *jz;
 
-#define NUMBER_BUCKETS 16
-static struct bucket {
-	uint64_t tick_boundry;
-	uint64_t count;
-	uint64_t time_boundry;
-} b[NUMBER_BUCKETS];
-
-static uint64_t accumulated_lost_ticks;
-static uint64_t delta_time = 500; /* nano sec */
-static uint64_t delta_tick_min; /* first bucket's tick boundry */
-#define RUN_TIME_DEFAULT 60
-static int run_time = RUN_TIME_DEFAULT; /* seconds */
-static int use_gettime = 1;
-#define NSEC_PER_SEC		1000000000
-/* how close do multiple run's calculated frequency have to be valid */
-#define FREQUENCY_TOLERNCE 0.01
-static inline void initialize_buckets(void)
-{
-	int i;
-
-	for (i = 0; i < NUMBER_BUCKETS; i++) {
-		b[i].count = 0;
-		if (i == 0) {
-			b[i].tick_boundry = delta_tick_min;
-			b[i].time_boundry = delta_time;
-		} else {
-			b[i].tick_boundry = b[i - 1].tick_boundry * 2;
-			b[i].time_boundry = b[i - 1].time_boundry * 2;
-		}
-	}
-}
-
-static inline void update_buckets(uint64_t ticks)
-{
-	if (ticks >= delta_tick_min) {
-		int i;
-
-		accumulated_lost_ticks += ticks;
-		for (i = NUMBER_BUCKETS; i > 0; i--) {
-			if (ticks >= b[i - 1].tick_boundry) {
-				b[i - 1].count++;
-				break;
-			}
-		}
-	}
-}
-
-/* Returns clock ticks */
-static inline uint64_t time_stamp_counter(void)
-{
-	uint64_t ret = -1;
+/* Events counted on each measured cpu with --perf */
+static const struct perf_event_desc {
+	const char *name;
+	uint32_t type;
+	uint64_t config; /* unused for tracepoints */
+	const char *tracepoint; /* events/ directory of a tracepoint */
+	/*
+	 * /proc/interrupts line that fires the event, "" for every
+	 * numbered line, to tell a counter that is stuck at 0
+	 */
+	const char *interrupts;
+} perf_events[] = {
+	{ "context-switches", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES },
+	{ "cpu-migrations", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CPU_MIGRATIONS },
+	{ "irq:irq_handler_entry", PERF_TYPE_TRACEPOINT, 0,
+	  "irq/irq_handler_entry", "" },
+	{ "irq:softirq_entry", PERF_TYPE_TRACEPOINT, 0, "irq/softirq_entry" },
+	{ "timer:hrtimer_expire_entry", PERF_TYPE_TRACEPOINT, 0,
+	  "timer/hrtimer_expire_entry", "LOC" },
+};
+#define NUMBER_PERF_EVENTS (sizeof(perf_events) / sizeof(perf_events[0]))
 
-	if (use_gettime) {
-		struct timespec ts;
+/*
+ * --daemon
+ * Rolling windows over the interval samples.  The reporter keeps every
+ * sample of the last five minutes and one a minute for the last hour;
+ * a window is the difference of the newest sample and the newest one
+ * at least the window older, so any window costs a scan of the rings.
+ */
+#define WINDOW_RECENT_SECONDS 300
+#define WINDOW_MINUTES 61
+static const struct window {
+	const char *name;
+	int seconds;
+} windows[] = {
+	{ "1m", 60 },
+	{ "5m", 300 },
+	{ "1h", 3600 },
+};
+#define NUMBER_WINDOWS (sizeof(windows) / sizeof(windows[0]))
 
-		if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1) {
-			fprintf(stderr, "clock_gettime() call failed: %s\n", strerror(errno));
-			exit (errno);
-		}
-		ret = (uint64_t) ((ts.tv_sec * NSEC_PER_SEC) + ts.tv_nsec);
-	}
-	else {
-#if defined(__i386__) || defined(__x86_64__)
-		uint32_t l, h;
+struct window_history {
+	struct interval_sample *recent; /* ring of recent_size */
+	int recent_size;
+	uint64_t recent_count;
+	struct interval_sample minutes[WINDOW_MINUTES]; /* ring */
+	uint64_t minutes_count;
+};
 
-		__asm__ __volatile__("lfence");
-		__asm__ __volatile__("rdtsc" : "=a"(l), "=d"(h));
-		ret = ((uint64_t)h << 32) | l;
-#else
-		fprintf(stderr,
-			"Add a time_stamp_counter function for your arch here %s:%d\n",
-			__FILE__, __LINE__);
-		exit(1);
-#endif
-	}
-	return ret;
-}
+/*
+ * What main and the reporter track of each measured cpu, in cpu_states
+ * order.  The measurement threads never touch it.
+ */
+static struct cpu_probes {
+	int cpu;
+	/* reporter only, last interval sample seen */
+	struct interval_sample last_interval;
+	struct window_history history; /* reporter only, --daemon */
+	uint64_t stall_written; /* reporter only, --stall-file */
+	uint64_t probe_lost_ticks; /* lost ticks at probes_last_second */
+	uint64_t smi_start, smi_end; /* MSR_SMI_COUNT, see --smi */
+	/* --perf, one counter per event */
+	int perf_fd[NUMBER_PERF_EVENTS]; /* -1 if it did not open */
+	uint64_t perf_start[NUMBER_PERF_EVENTS];
+	uint64_t perf_end[NUMBER_PERF_EVENTS];
+	uint64_t perf_last[NUMBER_PERF_EVENTS]; /* reporter only */
+} *probes;
 
-static inline int move_to_core()
-{
-	cpu_set_t cpus;
+static bool bench_record;
+static bool daemon_mode; /* --daemon */
+static bool interval_quiet; /* --daemon without -i, keep samples quiet */
+static const char *metrics_file; /* --metrics-file */
+/* --stall-file, only the reporter writes it once the test started */
+#define STALL_FILE_LOG 65536 /* stall ring without --stall-log */
+static const char *stall_file_name;
+static FILE *stall_file;
+static struct jitterz_stall_file_header *stall_header;
+static size_t stall_header_size;
+static struct jitterz_stall_file_record *stall_buf; /* a ring's worth */
+static uint64_t stall_file_dropped;
+static bool stall_log_quiet; /* the ring is only there for the file */
+static bool dl_deadline_set; /* else the deadline is the period */
+static int housekeeping_cpu = -1; /* where the reporter runs */
+static pthread_t reporter_thread;
+static int measurement_done;
+static bool irq_stats; /* --irqs */
+static bool smi_stats; /* --smi */
+static bool perf_stats; /* --perf */
+static int audit; /* 1 --audit, 2 --audit-only */
 
-	CPU_ZERO(&cpus);
-	CPU_SET(cpu, &cpus);
-	return sched_setaffinity(0, sizeof(cpus), &cpus);
-}
+#define RUN_TIME_DEFAULT 60
+static int run_time = RUN_TIME_DEFAULT; /* seconds */
+static const char *wss_arg = "llc"; /* working set size or cache name */
+/* how far the frequency seen over the run may be from the calibration */
+#define FREQUENCY_TOLERNCE 0.01
+/* warn when the threshold is within this factor of the loop's floor */
+#define FLOOR_FACTOR 4
 
-static inline int set_sched(void)
-{
-	struct sched_param p = { 0 };
+enum output_format {
+	OUTPUT_TEXT,
+	OUTPUT_JSON,
+	OUTPUT_CSV,
+};
+static enum output_format output_format = OUTPUT_TEXT;
+static FILE *progress; /* interval reports, stdout unless it is structured */
 
-	p.sched_priority = priority;
-	return sched_setscheduler(0, policy, &p);
-}
+static const double percentiles[] = { 50, 99, 99.9, 99.99 };
+#define NUMBER_PERCENTILES (sizeof(percentiles) / sizeof(percentiles[0]))
 
-static inline uint64_t read_cpu_current_frequency()
+static void print_clock_costs(void)
 {
-	uint64_t ret = -1;
-	char path[256];
-	struct stat sb;
 	int i;
-	char *freq[3] = {
-		/* scaling_cur_freq is current kernel /sys file */
-		"scaling_cur_freq"
-		/* old /sys file is cpuinfo_cur_freq */
-		"cpuinfo_cur_freq",
-		/* assumes a busy wait will be run at the max freq */
-		"cpuinfo_max_freq",
-	};
-	for (i = 0; i < 3 && ret == -1; i++) {
-		snprintf(path, 256, "/sys/devices/system/cpu/cpu%d/cpufreq/%s",
-			 cpu, freq[i]);
-		if (!stat(path, &sb)) {
-			FILE *f = 0;
-
-			f = fopen(path, "rt");
-			if (f) {
-				fscanf(f, "%" PRIu64, &ret);
-				/*
-				 * sysfs interface is in units of KHz
-				 * convert to Hz
-				 */
-				ret *= 1000;
-				fclose(f);
-			}
-		}
-	}
 
-	if (ret == -1) {
-		printf("Error reading CPU frequency for core %d\n", cpu);
-		exit(1);
+	fprintf(stdout, "clock : nsec per call : resolution nsec\n");
+	for (i = 0; i < NUMBER_CLOCKS; i++) {
+		if (!jz->clock_costs[i].supported) {
+			fprintf(stdout, "%s : unsupported\n",
+				jitterz_clocks[i].name);
+			continue;
+		}
+		fprintf(stdout, "%s : %.1f : %ld%s\n", jitterz_clocks[i].name,
+			jz->clock_costs[i].ns_per_call,
+			jz->clock_costs[i].resolution_ns,
+			i == clocksel &&
+					config.time_source == JITTERZ_TS_GETTIME ?
+				" (selected)" : "");
 	}
-	return ret;
 }
 
 /* Print usage information */
@@ -174,67 +178,201 @@ static inline void display_help(int error)
 	printf("Usage:\n"
 	       "jitterz <options>\n\n"
 	       "-c NUM   --cpu=NUM         which cpu to run on\n"
+	       "         --cpus=LIST       measure every cpu of LIST, e.g. 2,4-7, at once\n"
 	       "         --clock=CLOCK     select clock\n"
 	       "                           0 = CLOCK_MONOTONIC (default)\n"
 	       "                           1 = CLOCK_REALTIME\n"
+	       "                           2 = CLOCK_MONOTONIC_RAW\n"
+	       "                           3 = CLOCK_BOOTTIME\n"
+	       "                           4 = CLOCK_TAI\n"
+	       "                           5 = CLOCK_MONOTONIC_COARSE\n"
+	       "                           6 = CLOCK_REALTIME_COARSE\n"
+	       "                           or the name, e.g. monotonic_raw\n"
 	       "-d SEC   --duration=SEC    duration of the test in seconds\n"
 	       "-p PRIO  --priority=PRIO   priority of highest prio thread\n"
 	       "         --policy=NAME     policy of measurement thread, where NAME may be one\n"
-	       "                           of: other, normal, batch, idle, fifo or rr.\n"
+	       "                           of: other, normal, batch, idle, fifo, rr or\n"
+	       "                           deadline.\n"
+	       "         --dl-runtime=USEC deadline runtime, default 500\n"
+	       "         --dl-deadline=USEC deadline relative deadline, default the period\n"
+	       "         --dl-period=USEC  deadline period, default 1000\n"
 	       "         --rdtsc           use inline RDTSC instruction rather than clock_gettime()\n"
+	       "                           (the virtual counter on arm64)\n"
+	       "         --rdtscp          use inline RDTSCP instruction rather than clock_gettime()\n"
+	       "         --stall-log=NUM   keep the last NUM stalls per cpu and print them\n"
+	       "                           at the end of the test\n"
+	       "         --hdr[=DIGITS]    also record stalls in a log-linear histogram with\n"
+	       "                           DIGITS (1-3, default 2) significant digits and\n"
+	       "                           print stall percentiles\n"
+	       "         --fine[=NSEC]     histogram every delta of the loop below NSEC\n"
+	       "                           (default 500) in 64 linear buckets\n"
+	       "         --top=NUM         report the NUM longest stalls with the wall\n"
+	       "                           clock time they started\n"
+	       "         --correlate[=NUM] split stalls into global ones, overlapping\n"
+	       "                           stalls of NUM (default 2) or more cpus, and\n"
+	       "                           local ones\n"
+	       "-i SEC   --interval=SEC    report the stalls of every SEC seconds while\n"
+	       "                           the test runs\n"
+	       "         --housekeeping=NUM cpu for the interval reporter, default is the\n"
+	       "                           first cpu not measured\n"
+	       "         --irqs            report the interrupts and softirqs that fired on\n"
+	       "                           the measured cpus (per interval with -i)\n"
+	       "         --smi             count System Management Interrupts (x86, needs\n"
+	       "                           the msr module)\n"
+	       "         --perf            count context switches, migrations, irqs,\n"
+	       "                           softirqs and hrtimers on the measured cpus\n"
+	       "         --tracemark=USEC  write a trace_marker for every stall of USEC or more\n"
+	       "-b USEC  --breaktrace=USEC on the first stall of USEC or more write a\n"
+	       "                           trace_marker, stop tracing and end the test\n"
+	       "         --mode=MODE       busy (default) looks for gaps in a tight loop,\n"
+	       "                           timer measures clock_nanosleep() wakeup latency\n"
+	       "                           memory walks a working set between reads\n"
+	       "         --period=USEC     timer mode wakeup period, default 1000\n"
+	       "         --wss=SIZE        memory mode working set, bytes (K, M, G) or\n"
+	       "                           l1, l2, l3, llc (half the cache, default llc)\n"
+	       "                           or dram (four times the last level cache)\n"
+	       "         --access=PATTERN  memory mode chase (default) or stream\n"
+	       "         --accesses=NUM    memory mode loads per iteration, default 16\n"
+	       "         --audit           check how well the cpus are isolated first\n"
+	       "         --audit-only      only check how well the cpus are isolated\n"
+	       "         --output=FORMAT   report format: text (default), json or csv\n"
+	       "         --daemon          run until SIGTERM or SIGINT keeping rolling 1m,\n"
+	       "                           5m and 1h windows, then report\n"
+	       "         --metrics-file=FILE with --daemon, rewrite FILE in Prometheus text\n"
+	       "                           format every interval\n"
+	       "         --shm=NAME        publish the live counts of every cpu in POSIX\n"
+	       "                           shared memory NAME, e.g. /jitterz\n"
+	       "         --stall-file=FILE write every stall to FILE in a binary format\n"
+	       "                           for jitterz-decode\n"
+	       "         --bench-record    measure the cost of recording a stall of each\n"
+	       "                           bucket size and exit\n"
 		);
 	if (error)
 		exit(EXIT_FAILURE);
 	exit(EXIT_SUCCESS);
 }
 
-static inline char *policyname()
-{
-	char *policystr = "";
-
-	switch (policy) {
-	case SCHED_OTHER:
-		policystr = "other";
-		break;
-	case SCHED_FIFO:
-		policystr = "fifo";
-		break;
-	case SCHED_RR:
-		policystr = "rr";
-		break;
-	case SCHED_BATCH:
-		policystr = "batch";
-		break;
-	case SCHED_IDLE:
-		policystr = "idle";
-		break;
-	}
-	return policystr;
-}
-
 static inline void handlepolicy(char *polname)
 {
 	if (strncasecmp(polname, "other", 5) == 0)
-		policy = SCHED_OTHER;
+		config.policy = SCHED_OTHER;
 	else if (strncasecmp(polname, "batch", 5) == 0)
-		policy = SCHED_BATCH;
+		config.policy = SCHED_BATCH;
 	else if (strncasecmp(polname, "idle", 4) == 0)
-		policy = SCHED_IDLE;
+		config.policy = SCHED_IDLE;
 	else if (strncasecmp(polname, "fifo", 4) == 0)
-		policy = SCHED_FIFO;
+		config.policy = SCHED_FIFO;
 	else if (strncasecmp(polname, "rr", 2) == 0)
-		policy = SCHED_RR;
+		config.policy = SCHED_RR;
+	else if (strncasecmp(polname, "deadline", 8) == 0)
+		config.policy = SCHED_DEADLINE;
 	else /* default policy if we don't recognize the request */
-		policy = SCHED_OTHER;
+		config.policy = SCHED_OTHER;
+}
+
+/* --clock takes a number or a name, returns the index into clocks[] */
+static inline int handleclock(char *clkname)
+{
+	char *end;
+	int i = strtol(clkname, &end, 10);
+
+	if (end != clkname && !*end)
+		return i >= 0 && i < NUMBER_CLOCKS ? i : -1;
+	for (i = 0; i < NUMBER_CLOCKS; i++)
+		if (strcasecmp(clkname, jitterz_clocks[i].name) == 0 ||
+		    (strncasecmp(clkname, "clock_", 6) == 0 &&
+		     strcasecmp(clkname + 6, jitterz_clocks[i].name) == 0))
+			return i;
+	return -1;
+}
+
+/*
+ * Parse a cpu list such as "1,3-5" into cpu_list.
+ * Returns the number of cpus, or -1 on a malformed or out of range list.
+ */
+static int parse_cpu_list(const char *str, long max_cpus)
+{
+	int n = 0;
+	const char *p = str;
+
+	while (*p) {
+		char *end;
+		long first, last, c;
+
+		first = strtol(p, &end, 10);
+		if (end == p)
+			return -1;
+		last = first;
+		p = end;
+		if (*p == '-') {
+			p++;
+			last = strtol(p, &end, 10);
+			if (end == p)
+				return -1;
+			p = end;
+		}
+		if (first < 0 || last < first || last >= max_cpus)
+			return -1;
+		for (c = first; c <= last; c++) {
+			int i;
+
+			for (i = 0; i < n; i++)
+				if (cpu_list[i] == c)
+					break;
+			if (i < n)
+				continue;
+			cpu_list = realloc(cpu_list, (n + 1) * sizeof(*cpu_list));
+			if (!cpu_list) {
+				fprintf(stderr, "Out of memory\n");
+				exit(1);
+			}
+			cpu_list[n++] = c;
+		}
+		if (*p == ',')
+			p++;
+		else if (*p)
+			return -1;
+	}
+	return n ? n : -1;
 }
 
 enum option_values {
 	OPT_CPU = 1,
+	OPT_CPUS,
 	OPT_CLOCK,
 	OPT_DURATION,
 	OPT_PRIORITY,
 	OPT_POLICY,
+	OPT_DL_RUNTIME,
+	OPT_DL_DEADLINE,
+	OPT_DL_PERIOD,
 	OPT_RDTSC,
+	OPT_RDTSCP,
+	OPT_STALL_LOG,
+	OPT_HDR,
+	OPT_FINE,
+	OPT_TOP,
+	OPT_CORRELATE,
+	OPT_BENCH_RECORD,
+	OPT_INTERVAL,
+	OPT_HOUSEKEEPING,
+	OPT_OUTPUT,
+	OPT_DAEMON,
+	OPT_METRICS_FILE,
+	OPT_SHM,
+	OPT_STALL_FILE,
+	OPT_IRQS,
+	OPT_SMI,
+	OPT_PERF,
+	OPT_TRACEMARK,
+	OPT_BREAKTRACE,
+	OPT_MODE,
+	OPT_PERIOD,
+	OPT_WSS,
+	OPT_ACCESS,
+	OPT_ACCESSES,
+	OPT_AUDIT,
+	OPT_AUDIT_ONLY,
 	OPT_HELP,
 };
 
@@ -250,14 +388,51 @@ static inline void process_options(int argc, char *argv[], long max_cpus)
 		static const struct option long_options[] = {
 			{ "clock", required_argument, NULL, OPT_CLOCK },
 			{ "cpu", required_argument, NULL, OPT_CPU },
+			{ "cpus", required_argument, NULL, OPT_CPUS },
 			{ "duration", required_argument, NULL, OPT_DURATION },
 			{ "priority", required_argument, NULL, OPT_PRIORITY },
 			{ "policy", required_argument, NULL, OPT_POLICY },
+			{ "dl-runtime", required_argument, NULL,
+			  OPT_DL_RUNTIME },
+			{ "dl-deadline", required_argument, NULL,
+			  OPT_DL_DEADLINE },
+			{ "dl-period", required_argument, NULL, OPT_DL_PERIOD },
 			{ "rdtsc", optional_argument, NULL, OPT_RDTSC },
+			{ "rdtscp", no_argument, NULL, OPT_RDTSCP },
+			{ "stall-log", required_argument, NULL, OPT_STALL_LOG },
+			{ "hdr", optional_argument, NULL, OPT_HDR },
+			{ "fine", optional_argument, NULL, OPT_FINE },
+			{ "top", required_argument, NULL, OPT_TOP },
+			{ "correlate", optional_argument, NULL,
+			  OPT_CORRELATE },
+			{ "bench-record", no_argument, NULL, OPT_BENCH_RECORD },
+			{ "interval", required_argument, NULL, OPT_INTERVAL },
+			{ "housekeeping", required_argument, NULL,
+			  OPT_HOUSEKEEPING },
+			{ "output", required_argument, NULL, OPT_OUTPUT },
+			{ "daemon", no_argument, NULL, OPT_DAEMON },
+			{ "metrics-file", required_argument, NULL,
+			  OPT_METRICS_FILE },
+			{ "shm", required_argument, NULL, OPT_SHM },
+			{ "stall-file", required_argument, NULL,
+			  OPT_STALL_FILE },
+			{ "irqs", no_argument, NULL, OPT_IRQS },
+			{ "smi", no_argument, NULL, OPT_SMI },
+			{ "perf", no_argument, NULL, OPT_PERF },
+			{ "tracemark", required_argument, NULL, OPT_TRACEMARK },
+			{ "breaktrace", required_argument, NULL,
+			  OPT_BREAKTRACE },
+			{ "mode", required_argument, NULL, OPT_MODE },
+			{ "period", required_argument, NULL, OPT_PERIOD },
+			{ "wss", required_argument, NULL, OPT_WSS },
+			{ "access", required_argument, NULL, OPT_ACCESS },
+			{ "accesses", required_argument, NULL, OPT_ACCESSES },
+			{ "audit", no_argument, NULL, OPT_AUDIT },
+			{ "audit-only", no_argument, NULL, OPT_AUDIT_ONLY },
 			{ "help", no_argument, NULL, OPT_HELP },
 			{ NULL, 0, NULL, 0 },
 		};
-		int c = getopt_long(argc, argv, "c:d:hp:", long_options,
+		int c = getopt_long(argc, argv, "b:c:d:hi:p:", long_options,
 				    &option_index);
 		if (c == -1)
 			break;
@@ -268,8 +443,19 @@ static inline void process_options(int argc, char *argv[], long max_cpus)
 			if (cpu >= max_cpus)
 				cpu = CPU_DEFAULT;
 			break;
+		case OPT_CPUS:
+			num_cpus = parse_cpu_list(optarg, max_cpus);
+			if (num_cpus < 0) {
+				fprintf(stderr, "Invalid cpu list '%s'\n", optarg);
+				display_help(1);
+			}
+			break;
 		case OPT_CLOCK:
-			clocksel = atoi(optarg);
+			clocksel = handleclock(optarg);
+			if (clocksel < 0) {
+				fprintf(stderr, "Unknown clock '%s'\n", optarg);
+				display_help(1);
+			}
 			break;
 		case 'd':
 		case OPT_DURATION:
@@ -279,9 +465,9 @@ static inline void process_options(int argc, char *argv[], long max_cpus)
 			break;
 		case 'p':
 		case OPT_PRIORITY:
-			priority = atoi(optarg);
-			if (policy != SCHED_FIFO && policy != SCHED_RR)
-				policy = SCHED_FIFO;
+			config.priority = atoi(optarg);
+			if (config.policy != SCHED_FIFO && config.policy != SCHED_RR)
+				config.policy = SCHED_FIFO;
 			break;
 		case '?':
 		case OPT_HELP:
@@ -290,129 +476,2316 @@ static inline void process_options(int argc, char *argv[], long max_cpus)
 		case OPT_POLICY:
 			handlepolicy(optarg);
 			break;
+		case OPT_DL_RUNTIME:
+			config.dl_runtime_ns = strtoull(optarg, NULL, 0) * 1000;
+			break;
+		case OPT_DL_DEADLINE:
+			config.dl_deadline_ns = strtoull(optarg, NULL, 0) * 1000;
+			dl_deadline_set = true;
+			break;
+		case OPT_DL_PERIOD:
+			config.dl_period_ns = strtoull(optarg, NULL, 0) * 1000;
+			break;
 		case OPT_RDTSC:
-			use_gettime = 0;
+#if defined(__aarch64__)
+			config.time_source = JITTERZ_TS_CNTVCT;
+#else
+			config.time_source = JITTERZ_TS_RDTSC;
+#endif
+			break;
+		case OPT_RDTSCP:
+			config.time_source = JITTERZ_TS_RDTSCP;
+			break;
+		case OPT_STALL_LOG:
+			config.stall_log = strtoull(optarg, NULL, 0);
+			break;
+		case OPT_HDR:
+			config.hdr_digits = optarg ? atoi(optarg) : HDR_DIGITS_DEFAULT;
+			if (config.hdr_digits < 1 || config.hdr_digits > 3)
+				config.hdr_digits = HDR_DIGITS_DEFAULT;
+			break;
+		case OPT_FINE:
+			config.fine_ns = optarg ? strtoull(optarg, NULL, 0) :
+						  config.threshold_ns;
 			break;
+		case OPT_TOP:
+			config.top_stalls = atoi(optarg);
+			if (config.top_stalls < 0)
+				config.top_stalls = 0;
+			break;
+		case OPT_CORRELATE:
+			config.correlate = optarg ? atoi(optarg) : 2;
+			break;
+		case OPT_BENCH_RECORD:
+			bench_record = true;
+			break;
+		case 'i':
+		case OPT_INTERVAL:
+			config.interval = atoi(optarg);
+			if (config.interval < 0)
+				config.interval = 0;
+			break;
+		case OPT_HOUSEKEEPING:
+			housekeeping_cpu = atoi(optarg);
+			if (housekeeping_cpu >= max_cpus)
+				housekeeping_cpu = -1;
+			break;
+		case OPT_IRQS:
+			irq_stats = true;
+			break;
+		case OPT_SMI:
+			smi_stats = true;
+			break;
+		case OPT_PERF:
+			perf_stats = true;
+			break;
+		case OPT_TRACEMARK:
+			config.tracemark_ns = strtoull(optarg, NULL, 0) * 1000;
+			break;
+		case 'b':
+		case OPT_BREAKTRACE:
+			config.breaktrace_ns = strtoull(optarg, NULL, 0) * 1000;
+			break;
+		case OPT_MODE:
+			if (strcasecmp(optarg, "busy") == 0)
+				config.mode = JITTERZ_MODE_BUSY;
+			else if (strcasecmp(optarg, "timer") == 0)
+				config.mode = JITTERZ_MODE_TIMER;
+			else if (strcasecmp(optarg, "memory") == 0)
+				config.mode = JITTERZ_MODE_MEMORY;
+			else {
+				fprintf(stderr, "Unknown mode '%s'\n", optarg);
+				display_help(1);
+			}
+			break;
+		case OPT_PERIOD:
+			config.period_ns = strtoull(optarg, NULL, 0) * 1000;
+			if (!config.period_ns)
+				config.period_ns = TIMER_PERIOD_DEFAULT;
+			break;
+		case OPT_WSS:
+			wss_arg = optarg;
+			break;
+		case OPT_ACCESS:
+			if (strcasecmp(optarg, "chase") == 0)
+				config.access = JITTERZ_ACCESS_CHASE;
+			else if (strcasecmp(optarg, "stream") == 0)
+				config.access = JITTERZ_ACCESS_STREAM;
+			else {
+				fprintf(stderr, "Unknown access pattern '%s'\n",
+					optarg);
+				display_help(1);
+			}
+			break;
+		case OPT_ACCESSES:
+			config.accesses = atoi(optarg);
+			if (config.accesses <= 0)
+				config.accesses = ACCESSES_DEFAULT;
+			break;
+		case OPT_AUDIT:
+			audit = 1;
+			break;
+		case OPT_DAEMON:
+			daemon_mode = true;
+			break;
+		case OPT_METRICS_FILE:
+			metrics_file = optarg;
+			daemon_mode = true;
+			break;
+		case OPT_SHM:
+			config.shm_name = optarg;
+			break;
+		case OPT_STALL_FILE:
+			stall_file_name = optarg;
+			break;
+		case OPT_AUDIT_ONLY:
+			audit = 2;
+			break;
+		case OPT_OUTPUT:
+			if (strcasecmp(optarg, "json") == 0)
+				output_format = OUTPUT_JSON;
+			else if (strcasecmp(optarg, "csv") == 0)
+				output_format = OUTPUT_CSV;
+			else if (strcasecmp(optarg, "text") == 0)
+				output_format = OUTPUT_TEXT;
+			else {
+				fprintf(stderr, "Unknown output format '%s'\n",
+					optarg);
+				display_help(1);
+			}
+			break;
+		}
+	}
+
+	/* without --cpus measure the single -c cpu */
+	if (!num_cpus) {
+		num_cpus = 1;
+		cpu_list = malloc(sizeof(*cpu_list));
+		if (!cpu_list) {
+			fprintf(stderr, "Out of memory\n");
+			exit(1);
+		}
+		cpu_list[0] = cpu;
+	}
+	if (!dl_deadline_set)
+		config.dl_deadline_ns = config.dl_period_ns;
+	if (stall_file_name && !config.stall_log) {
+		config.stall_log = STALL_FILE_LOG;
+		stall_log_quiet = true;
+	}
+	/* the windows are built from interval samples */
+	if (daemon_mode) {
+		run_time = 0;
+		if (!config.interval) {
+			config.interval = 1;
+			interval_quiet = true;
 		}
 	}
 }
 
-int main(int argc, char **argv)
+static void window_add(struct window_history *h,
+		       const struct interval_sample *sample)
 {
-	long max_cpus = sysconf(_SC_NPROCESSORS_ONLN);
-	struct timespec tvs, tve;
-	double real_duration; /* sec */
-	int i;
-	uint64_t test_tick_start, test_tick_end;
-	static uint64_t frequency_start, frequency_run;
-	double frequency_diff = 0.0; /* unitless */
+	struct interval_sample *minute =
+		&h->minutes[(h->minutes_count - 1) % WINDOW_MINUTES];
 
-	process_options(argc, argv, max_cpus);
+	h->recent[h->recent_count++ % h->recent_size] = *sample;
+	if (!h->minutes_count || minute->second / 60 != sample->second / 60)
+		h->minutes[h->minutes_count++ % WINDOW_MINUTES] = *sample;
+}
 
-	/* return of this function must be tested for success */
-	if (move_to_core() != 0) {
-		fprintf(stderr,
-			"Error while setting thread affinity to cpu %d\n", cpu);
-		exit(1);
+/*
+ * The newest sample at or before second from, the start of the test
+ * if the history does not reach back that far
+ */
+static const struct interval_sample *
+window_base(const struct window_history *h, int from)
+{
+	static const struct interval_sample start;
+	const struct interval_sample *base = &start;
+	uint64_t i;
+
+	/* every sample is in recent, it is the better one where it reaches */
+	for (i = h->minutes_count > WINDOW_MINUTES ?
+			 h->minutes_count - WINDOW_MINUTES : 0;
+	     i < h->minutes_count; i++) {
+		if (h->minutes[i % WINDOW_MINUTES].second > from)
+			break;
+		base = &h->minutes[i % WINDOW_MINUTES];
 	}
-	if (set_sched() != 0) {
-		fprintf(stderr, "Error while setting %s policy, priority %d\n",
-			policyname(), priority);
-		exit(1);
+	for (i = h->recent_count > (uint64_t)h->recent_size ?
+			 h->recent_count - h->recent_size : 0;
+	     i < h->recent_count; i++) {
+		if (h->recent[i % h->recent_size].second > from)
+			break;
+		base = &h->recent[i % h->recent_size];
 	}
+	return base;
+}
 
-	if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0) {
-		fprintf(stderr, "Error while locking process memory\n");
-		exit(1);
+/*
+ * --metrics-file
+ * Prometheus text format for the node_exporter textfile collector.  It
+ * is written to a .tmp file next to it and renamed over it, so the
+ * collector, which only reads *.prom, never sees half a file.
+ */
+static void write_metrics(void)
+{
+	char tmp[4096];
+	size_t w;
+	int i, n;
+	FILE *f;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", metrics_file);
+	f = fopen(tmp, "w");
+	if (!f) {
+		fprintf(stderr, "Warning: could not write %s: %s\n", tmp,
+			strerror(errno));
+		return;
 	}
+	fprintf(f, "# HELP jitterz_measured_seconds_total Seconds measured since jitterz started.\n"
+		   "# TYPE jitterz_measured_seconds_total counter\n");
+	for (n = 0; n < num_cpus; n++)
+		fprintf(f, "jitterz_measured_seconds_total{cpu=\"%d\"} %d\n",
+			probes[n].cpu, probes[n].last_interval.second);
+	fprintf(f, "# HELP jitterz_lost_seconds_total Time lost to stalls since jitterz started.\n"
+		   "# TYPE jitterz_lost_seconds_total counter\n");
+	for (n = 0; n < num_cpus; n++)
+		fprintf(f, "jitterz_lost_seconds_total{cpu=\"%d\"} %.9f\n",
+			probes[n].cpu,
+			(double)probes[n].last_interval.lost_ticks /
+				jz->frequency);
+	fprintf(f, "# HELP jitterz_window_seconds Seconds a window covers, less than its name early on.\n"
+		   "# TYPE jitterz_window_seconds gauge\n");
+	for (n = 0; n < num_cpus; n++) {
+		const struct interval_sample *now = &probes[n].last_interval;
 
-	frequency_run = 0;
-	frequency_start = read_cpu_current_frequency();
-	/*
-	 * Start off using the cpu frequency from sysfs
-	 * After each loop
-	 *   calculate the real frequency the whole test
-	 *   run until the real frequency is close enough to the last run
-	 */
-	do {
-	retry:
-		if (frequency_run)
-			frequency_start = frequency_run;
-		delta_tick_min = (delta_time * frequency_start) /
-				 1000000000; /* ticks/nsec */
-
-		accumulated_lost_ticks = 0;
-		initialize_buckets();
-
-		/* record the starting tick and clock time for the test */
-		test_tick_start = time_stamp_counter();
-		clock_gettime(CLOCK_MONOTONIC_RAW, &tvs);
-
-		/* loop over seconds run time */
-		for (i = 0; i < run_time; i++) {
-			uint64_t tick, end_tick, old_tick, tick_overflow;
-
-			end_tick = old_tick = tick = time_stamp_counter();
-			end_tick += frequency_start;
-			/*
-			 * Overflow check
-			 * If end_tick < tick, there will be an overlow
-			 * Add additional second's worth of ticks so
-			 * we do not have to check inside the while loop
-			 * to cover the case that end_tick is close to
-			 * overflowing.
-			 */
-			tick_overflow = end_tick + frequency_start;
-			if (tick_overflow < tick)
-				goto retry;
+		for (w = 0; w < NUMBER_WINDOWS; w++)
+			fprintf(f, "jitterz_window_seconds{cpu=\"%d\",window=\"%s\"} %d\n",
+				probes[n].cpu, windows[w].name,
+				now->second -
+					window_base(&probes[n].history,
+						    now->second -
+							    windows[w].seconds)
+						->second);
+	}
+	fprintf(f, "# HELP jitterz_window_lost_seconds Time lost to stalls in the window.\n"
+		   "# TYPE jitterz_window_lost_seconds gauge\n");
+	for (n = 0; n < num_cpus; n++) {
+		const struct interval_sample *now = &probes[n].last_interval;
 
-			/*
-			 * Loop until tick >= end_tick
-			 *
-			 * If the difference in old and current tick
-			 * exceed the minimum tick treshold
-			 *   increment the greatest bucket
-			 *   accumulate total lost ticks
-			 *
-			 * set old_tick to current tick
-			 */
-			while (tick < end_tick) {
-				tick = time_stamp_counter();
-				if (tick == old_tick)
-					continue;
-				update_buckets(tick - old_tick);
-				old_tick = tick;
-			}
+		for (w = 0; w < NUMBER_WINDOWS; w++) {
+			const struct interval_sample *base = window_base(
+				&probes[n].history,
+				now->second - windows[w].seconds);
+
+			fprintf(f, "jitterz_window_lost_seconds{cpu=\"%d\",window=\"%s\"} %.9f\n",
+				probes[n].cpu, windows[w].name,
+				(double)(now->lost_ticks - base->lost_ticks) /
+					jz->frequency);
 		}
-		/* Record the test ending tick and clock time */
-		test_tick_end = time_stamp_counter();
-		/* overflow */
-		if (test_tick_end < test_tick_start)
-			goto retry;
-		clock_gettime(CLOCK_MONOTONIC_RAW, &tve);
-		/* sec */
-		real_duration = tve.tv_sec - tvs.tv_sec +
-				(tve.tv_nsec - tvs.tv_nsec) / 1e9;
-		/* tick / sec */
-		frequency_run =
-			(test_tick_end - test_tick_start) / (real_duration);
-		frequency_diff = fabs((frequency_run * 1.) - frequency_start) /
-				 frequency_start;
-	} while (frequency_diff > FREQUENCY_TOLERNCE);
-
-	fprintf(stdout, "cutoff time (usec) : stall count \n");
-	for (i = 0; i < NUMBER_BUCKETS; i++) {
-		double t = b[i].time_boundry / 1000000000.; /* sec */
-		if (t < real_duration) {
-			double tb = b[i].time_boundry; /* nsec */
-			fprintf(stdout, "%.1f : %" PRIu64 "\n", tb / 1000.,
-				b[i].count);
+	}
+	fprintf(f, "# HELP jitterz_window_stalls Stalls in the window per bucket, cutoff_us is the shortest stall of the bucket.\n"
+		   "# TYPE jitterz_window_stalls gauge\n");
+	for (n = 0; n < num_cpus; n++) {
+		const struct interval_sample *now = &probes[n].last_interval;
+		struct cpu_state *s = &jz->cpu_states[n];
+
+		for (w = 0; w < NUMBER_WINDOWS; w++) {
+			const struct interval_sample *base = window_base(
+				&probes[n].history,
+				now->second - windows[w].seconds);
+
+			for (i = 0; i < NUMBER_BUCKETS; i++)
+				fprintf(f, "jitterz_window_stalls{cpu=\"%d\",window=\"%s\",cutoff_us=\"%g\"} %" PRIu64 "\n",
+					probes[n].cpu, windows[w].name,
+					s->b[i].time_boundry / 1000.,
+					now->counts[i] - base->counts[i]);
+		}
+	}
+	if (fclose(f) || rename(tmp, metrics_file))
+		fprintf(stderr, "Warning: could not write %s: %s\n",
+			metrics_file, strerror(errno));
+}
+
+/* Print what one cpu saw since its previous interval sample */
+static void report_interval(struct cpu_probes *p,
+			    const struct interval_sample *sample)
+{
+	struct interval_sample *last = &p->last_interval;
+	int i;
+
+	if (p->history.recent)
+		window_add(&p->history, sample);
+	if (interval_quiet) {
+		*last = *sample;
+		return;
+	}
+	fprintf(progress, "interval %d-%d sec : cpu %d : %s %f :",
+		last->second, sample->second, p->cpu,
+		config.mode == JITTERZ_MODE_MEMORY ? "over cutoff" : "lost",
+		(double)(sample->lost_ticks - last->lost_ticks) / jz->frequency);
+	for (i = 0; i < NUMBER_BUCKETS; i++)
+		fprintf(progress, " %" PRIu64,
+			sample->counts[i] - last->counts[i]);
+	fprintf(progress, "\n");
+	*last = *sample;
+}
+
+/* Drain every cpu's interval ring, returns how many samples were seen */
+static int drain_intervals(void)
+{
+	int n, seen = 0;
+
+	for (n = 0; n < num_cpus; n++) {
+		struct cpu_state *s = &jz->cpu_states[n];
+		struct interval_ring *r = s->intervals;
+		uint64_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+
+		while (r->tail < head) {
+			report_interval(&probes[n],
+					&r->samples[r->tail &
+						    (INTERVAL_RING_SIZE - 1)]);
+			__atomic_store_n(&r->tail, r->tail + 1,
+					 __ATOMIC_RELEASE);
+			seen++;
+		}
+	}
+	if (seen)
+		fflush(progress);
+	return seen;
+}
+
+/*
+ * --irqs
+ * Counts of every line of /proc/interrupts or /proc/softirqs for the
+ * measured cpus, so the interrupts that hit the measured cpus while they
+ * lost time can be named.  Only ever read by main and the reporter.
+ */
+struct irq_line {
+	char name[16];
+	char desc[48];
+	uint64_t *counts; /* one per measured cpu, in cpu_states order */
+};
+
+struct irq_snapshot {
+	int nlines;
+	struct irq_line *lines;
+};
+
+static struct irq_snapshot irqs_start, irqs_end, irqs_last;
+static struct irq_snapshot softirqs_start, softirqs_end, softirqs_last;
+/* end of the interval the reporter last sampled irqs, smi, ... at */
+static int probes_last_second;
+
+static void irq_snapshot_free(struct irq_snapshot *snap)
+{
+	int i;
+
+	for (i = 0; i < snap->nlines; i++)
+		free(snap->lines[i].counts);
+	free(snap->lines);
+	snap->lines = NULL;
+	snap->nlines = 0;
+}
+
+/*
+ * The header of both files names the cpu of each column, "CPU0 CPU2 ...",
+ * every other line is "NAME: count count ... description".  Lines such as
+ * ERR and MIS have a single count, which is kept in the first column.
+ */
+static int irq_snapshot_read(const char *path, struct irq_snapshot *snap)
+{
+	char *line = NULL, *p;
+	size_t size = 0;
+	int *column = NULL; /* measured cpu index of each column, or -1 */
+	int ncolumns = 0;
+	FILE *f;
+
+	irq_snapshot_free(snap);
+	f = fopen(path, "r");
+	if (!f)
+		return -1;
+	if (getline(&line, &size, f) < 0)
+		goto out;
+	for (p = line; (p = strstr(p, "CPU")); ncolumns++) {
+		int c = strtol(p + 3, &p, 10), n;
+
+		column = realloc(column, (ncolumns + 1) * sizeof(*column));
+		if (!column)
+			goto out;
+		column[ncolumns] = -1;
+		for (n = 0; n < num_cpus; n++)
+			if (jz->cpu_states[n].cpu == c)
+				column[ncolumns] = n;
+	}
+
+	while (getline(&line, &size, f) > 0) {
+		struct irq_line *l;
+		char *colon = strchr(line, ':');
+		char *name = line, *end;
+		int i;
+
+		if (!colon)
+			continue;
+		*colon = '\0';
+		while (*name == ' ')
+			name++;
+		snap->lines = realloc(snap->lines,
+				      (snap->nlines + 1) * sizeof(*snap->lines));
+		if (!snap->lines)
+			goto out;
+		l = &snap->lines[snap->nlines++];
+		snprintf(l->name, sizeof(l->name), "%s", name);
+		l->counts = calloc(num_cpus, sizeof(*l->counts));
+		if (!l->counts)
+			goto out;
+
+		p = colon + 1;
+		for (i = 0; i < ncolumns; i++) {
+			uint64_t v = strtoull(p, &end, 10);
+
+			if (end == p)
+				break;
+			if (column[i] >= 0)
+				l->counts[column[i]] = v;
+			p = end;
+		}
+		while (*p == ' ')
+			p++;
+		end = p + strlen(p);
+		while (end > p && (end[-1] == '\n' || end[-1] == ' '))
+			*--end = '\0';
+		snprintf(l->desc, sizeof(l->desc), "%s", p);
+	}
+out:
+	free(column);
+	free(line);
+	fclose(f);
+	return 0;
+}
+
+/* Line of the earlier snapshot with the same name, NULL if it is new */
+static struct irq_line *irq_match(const struct irq_snapshot *before,
+				  const struct irq_snapshot *after, int i)
+{
+	int j;
+
+	if (i < before->nlines &&
+	    !strcmp(before->lines[i].name, after->lines[i].name))
+		return &before->lines[i];
+	for (j = 0; j < before->nlines; j++)
+		if (!strcmp(before->lines[j].name, after->lines[i].name))
+			return &before->lines[j];
+	return NULL;
+}
+
+static uint64_t irq_delta(const struct irq_line *before,
+			  const struct irq_line *after, int n)
+{
+	return after->counts[n] - (before ? before->counts[n] : 0);
+}
+
+/* Print the lines that fired on any measured cpu, one column per cpu */
+static void print_irq_delta(FILE *out, const char *what,
+			    const struct irq_snapshot *before,
+			    const struct irq_snapshot *after)
+{
+	int i, n;
+
+	fprintf(out, "%s on measured cpus (name : count per cpu : description)\n",
+		what);
+	for (i = 0; i < after->nlines; i++) {
+		struct irq_line *l = &after->lines[i];
+		struct irq_line *b = irq_match(before, after, i);
+		bool fired = false;
+
+		for (n = 0; n < num_cpus; n++)
+			fired |= irq_delta(b, l, n) != 0;
+		if (!fired)
+			continue;
+		fprintf(out, "%s :", l->name);
+		for (n = 0; n < num_cpus; n++)
+			fprintf(out, " %" PRIu64, irq_delta(b, l, n));
+		fprintf(out, "%s%s\n", l->desc[0] ? " : " : "", l->desc);
+	}
+}
+
+static void read_irq_snapshots(struct irq_snapshot *irqs,
+			       struct irq_snapshot *softirqs)
+{
+	if (irq_snapshot_read("/proc/interrupts", irqs) ||
+	    irq_snapshot_read("/proc/softirqs", softirqs))
+		fprintf(stderr, "Warning: could not read interrupt counts\n");
+}
+
+/*
+ * Reporter, once every measured cpu has finished an interval: show the
+ * interrupts that fired on the measured cpus since the last one.
+ */
+static void report_interval_irqs(int from, int to)
+{
+	static struct irq_snapshot irqs, softirqs;
+	char what[64];
+
+	read_irq_snapshots(&irqs, &softirqs);
+	snprintf(what, sizeof(what), "interval %d-%d sec : interrupts",
+		 from, to);
+	print_irq_delta(progress, what, &irqs_last, &irqs);
+	snprintf(what, sizeof(what), "interval %d-%d sec : softirqs",
+		 from, to);
+	print_irq_delta(progress, what, &softirqs_last, &softirqs);
+
+	/* the new snapshot becomes the base of the next interval */
+	irq_snapshot_free(&irqs_last);
+	irq_snapshot_free(&softirqs_last);
+	irqs_last = irqs;
+	softirqs_last = softirqs;
+	memset(&irqs, 0, sizeof(irqs));
+	memset(&softirqs, 0, sizeof(softirqs));
+}
+
+/*
+ * --smi
+ * System Management Interrupts are invisible to the kernel, but Intel
+ * cpus count them in MSR_SMI_COUNT.  Reading another cpu's MSR through
+ * /dev/cpu/N/msr interrupts that cpu, so the measured cpus are only read
+ * before and after the test.  SMIs are broadcast to every cpu, so while
+ * the test runs the reporter reads the housekeeping cpu's count instead.
+ */
+#define MSR_SMI_COUNT 0x34
+static uint64_t smi_last; /* housekeeping cpu, at probes_last_second */
+
+static int read_smi_count(int cpu, uint64_t *count)
+{
+	char path[64];
+	int fd, ret = 0;
+
+	snprintf(path, sizeof(path), "/dev/cpu/%d/msr", cpu);
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	if (pread(fd, count, sizeof(*count), MSR_SMI_COUNT) != sizeof(*count))
+		ret = -1;
+	close(fd);
+	*count &= 0xffffffff; /* bits 63:32 are reserved */
+	return ret;
+}
+
+/*
+ * Read the SMI count of every measured cpu into the start or end slot.
+ * If the MSR can not be read SMI counting is turned off.
+ */
+static void read_smi_counts(bool end)
+{
+	int n;
+
+	for (n = 0; n < num_cpus; n++) {
+		struct cpu_probes *p = &probes[n];
+
+		if (read_smi_count(p->cpu, end ? &p->smi_end : &p->smi_start)) {
+			fprintf(stderr,
+				"Warning: could not read MSR_SMI_COUNT of cpu %d (is the msr module loaded?), SMIs are not counted\n",
+				p->cpu);
+			smi_stats = false;
+			return;
 		}
 	}
+}
 
-	printf("Lost time %f out of %d seconds\n",
-	       (double)accumulated_lost_ticks / (double)frequency_start,
-	       run_time);
+/*
+ * Reporter: SMIs since the last interval, flagging every measured cpu
+ * that lost time in an interval with SMIs.
+ */
+static void report_interval_smi(int from, int to)
+{
+	uint64_t count;
+	int n;
+
+	if (housekeeping_cpu < 0 || read_smi_count(housekeeping_cpu, &count))
+		return;
+	fprintf(progress, "interval %d-%d sec : smi %" PRIu64, from, to,
+		count - smi_last);
+	if (count != smi_last)
+		for (n = 0; n < num_cpus; n++) {
+			struct cpu_probes *p = &probes[n];
+
+			if (p->last_interval.lost_ticks != p->probe_lost_ticks)
+				fprintf(progress, " : cpu %d lost time with SMIs",
+					p->cpu);
+		}
+	fprintf(progress, "\n");
+	smi_last = count;
+}
+
+/*
+ * --perf
+ * Software and tracepoint counters scoped to each measured cpu.  Each is
+ * opened on its own: tracepoints put in the group of a software event
+ * are never scheduled in on some kernels and read 0.  Reading a counter
+ * that is active on another cpu makes the kernel IPI that cpu, so the
+ * counters are read once per interval at most.
+ */
+static int tracepoint_id(const char *tracepoint)
+{
+	static const char *const roots[] = {
+		"/sys/kernel/tracing/events",
+		"/sys/kernel/debug/tracing/events",
+	};
+	char path[256];
+	int i, id = -1;
+
+	for (i = 0; i < 2 && id < 0; i++) {
+		FILE *f;
+
+		snprintf(path, sizeof(path), "%s/%s/id", roots[i], tracepoint);
+		f = fopen(path, "r");
+		if (!f)
+			continue;
+		if (fscanf(f, "%d", &id) != 1)
+			id = -1;
+		fclose(f);
+	}
+	return id;
+}
+
+static void open_perf_events(struct cpu_probes *p)
+{
+	int i, opened = 0;
+
+	for (i = 0; i < NUMBER_PERF_EVENTS; i++) {
+		const struct perf_event_desc *e = &perf_events[i];
+		struct perf_event_attr attr = { 0 };
+		int fd;
+
+		p->perf_fd[i] = -1;
+		attr.size = sizeof(attr);
+		attr.type = e->type;
+		attr.config = e->config;
+		if (e->tracepoint) {
+			int id = tracepoint_id(e->tracepoint);
+
+			if (id < 0) {
+				fprintf(stderr,
+					"Warning: no tracepoint %s, not counted\n",
+					e->name);
+				continue;
+			}
+			attr.config = id;
+		}
+		fd = syscall(SYS_perf_event_open, &attr, -1, p->cpu, -1, 0);
+		if (fd < 0) {
+			fprintf(stderr,
+				"Warning: could not count %s on cpu %d: %s\n",
+				e->name, p->cpu, strerror(errno));
+			continue;
+		}
+		p->perf_fd[i] = fd;
+		opened++;
+	}
+	if (!opened)
+		perf_stats = false;
+}
+
+/* Read every counter of a cpu into counts[], indexed like perf_events */
+static int read_perf_events(struct cpu_probes *p, uint64_t *counts)
+{
+	int i;
+
+	for (i = 0; i < NUMBER_PERF_EVENTS; i++) {
+		counts[i] = 0;
+		if (p->perf_fd[i] >= 0 &&
+		    read(p->perf_fd[i], &counts[i], sizeof(counts[i])) !=
+			    sizeof(counts[i]))
+			return -1;
+	}
+	return 0;
+}
+
+/* /proc/interrupts when the counters were read, to check them against */
+static struct irq_snapshot perf_irqs_start, perf_irqs_end;
+
+/* What /proc/interrupts counted on measured cpu n for event e */
+static uint64_t perf_interrupts(const struct perf_event_desc *e, int n)
+{
+	uint64_t sum = 0;
+	int i;
+
+	for (i = 0; i < perf_irqs_end.nlines; i++) {
+		struct irq_line *l = &perf_irqs_end.lines[i];
+
+		if (e->interrupts[0] ? !strcmp(l->name, e->interrupts) :
+				       isdigit(l->name[0]))
+			sum += irq_delta(irq_match(&perf_irqs_start,
+						   &perf_irqs_end, i),
+					 l, n);
+	}
+	return sum;
+}
+
+/* Warn about counters that stayed at 0 while their interrupts fired */
+static void check_perf_counts(void)
+{
+	int i, n;
+
+	for (n = 0; n < num_cpus; n++) {
+		struct cpu_probes *p = &probes[n];
+
+		for (i = 0; i < NUMBER_PERF_EVENTS; i++) {
+			const struct perf_event_desc *e = &perf_events[i];
+			uint64_t fired;
+
+			if (!e->interrupts || p->perf_fd[i] < 0 ||
+			    p->perf_end[i] != p->perf_start[i])
+				continue;
+			fired = perf_interrupts(e, n);
+			if (fired)
+				fprintf(stderr,
+					"Warning: %s stayed at 0 on cpu %d while /proc/interrupts counted %" PRIu64 ", the counter does not work\n",
+					e->name, p->cpu, fired);
+		}
+	}
+}
+
+static void read_perf_counts(bool end)
+{
+	int n;
+
+	if (irq_snapshot_read("/proc/interrupts",
+			      end ? &perf_irqs_end : &perf_irqs_start))
+		fprintf(stderr, "Warning: could not read interrupt counts\n");
+	for (n = 0; n < num_cpus; n++) {
+		struct cpu_probes *p = &probes[n];
+
+		if (read_perf_events(p, end ? p->perf_end : p->perf_start))
+			fprintf(stderr,
+				"Warning: could not read perf events of cpu %d\n",
+				p->cpu);
+	}
+	if (end)
+		check_perf_counts();
+}
+
+static void report_interval_perf(int from, int to)
+{
+	uint64_t counts[NUMBER_PERF_EVENTS];
+	int i, n;
+
+	for (n = 0; n < num_cpus; n++) {
+		struct cpu_probes *p = &probes[n];
+
+		if (read_perf_events(p, counts))
+			continue;
+		fprintf(progress, "interval %d-%d sec : cpu %d : perf", from,
+			to, p->cpu);
+		for (i = 0; i < NUMBER_PERF_EVENTS; i++) {
+			if (p->perf_fd[i] < 0)
+				continue;
+			fprintf(progress, " : %s %" PRIu64, perf_events[i].name,
+				counts[i] - p->perf_last[i]);
+			p->perf_last[i] = counts[i];
+		}
+		fprintf(progress, "\n");
+	}
+}
+
+/* Reporter, once every measured cpu has finished an interval */
+static void report_interval_probes(void)
+{
+	int n, second = INT32_MAX;
+
+	for (n = 0; n < num_cpus; n++)
+		if (probes[n].last_interval.second < second)
+			second = probes[n].last_interval.second;
+	if (second <= probes_last_second)
+		return;
+
+	if (irq_stats)
+		report_interval_irqs(probes_last_second, second);
+	if (smi_stats)
+		report_interval_smi(probes_last_second, second);
+	if (perf_stats)
+		report_interval_perf(probes_last_second, second);
+	fflush(progress);
+
+	for (n = 0; n < num_cpus; n++)
+		probes[n].probe_lost_ticks =
+			probes[n].last_interval.lost_ticks;
+	probes_last_second = second;
+}
+
+/*
+ * --stall-file
+ * The header is written by main before the test and again by the
+ * reporter once the anchor of the ticks is known.
+ */
+static void write_stall_header(void)
+{
+	long end = ftell(stall_file);
+
+	fseek(stall_file, 0, SEEK_SET);
+	fwrite(stall_header, stall_header_size, 1, stall_file);
+	if (end > 0)
+		fseek(stall_file, end, SEEK_SET);
+}
+
+/*
+ * Append every cpu's new stalls from its stall ring.  The measurement
+ * thread may reuse a slot while it is copied, so stall_count is read
+ * again after the copy and records it may have lapped are counted as
+ * dropped rather than written.
+ */
+static void drain_stall_file(void)
+{
+	int n;
+
+	for (n = 0; n < num_cpus; n++) {
+		struct cpu_state *s = &jz->cpu_states[n];
+		struct cpu_probes *p = &probes[n];
+		uint64_t size = s->stall_mask + 1, m = 0, skip = 0;
+		uint64_t count = __atomic_load_n(&s->stall_count,
+						 __ATOMIC_ACQUIRE);
+		uint64_t first, i, lapped;
+
+		/* the test was restarted on a tick overflow */
+		if (count < p->stall_written)
+			p->stall_written = 0;
+		first = count - p->stall_written > size ? count - size :
+							  p->stall_written;
+		if (first == count)
+			continue;
+		if (!stall_header->anchor_tick) {
+			stall_header->anchor_tick = s->test_tick_start;
+			stall_header->anchor_realtime_ns = s->realtime_start;
+			write_stall_header();
+		}
+		for (i = first; i < count; i++) {
+			struct stall_record *r = &s->stalls[i & s->stall_mask];
+
+			stall_buf[m].start_tick = r->start_tick;
+			stall_buf[m].ticks = r->ticks;
+			stall_buf[m++].cpu = r->cpu;
+		}
+		/*
+		 * Records before lapped + 1 - size may have been overwritten
+		 * while they were copied, record lapped is being written
+		 * into the slot of lapped - size.
+		 */
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		lapped = __atomic_load_n(&s->stall_count, __ATOMIC_RELAXED);
+		if (lapped + 1 > first + size)
+			skip = lapped + 1 - size - first < m ?
+				       lapped + 1 - size - first : m;
+		fwrite(stall_buf + skip, sizeof(*stall_buf), m - skip,
+		       stall_file);
+		stall_file_dropped += first - p->stall_written + skip;
+		p->stall_written = count;
+	}
+}
+
+static void close_stall_file(void)
+{
+	drain_stall_file();
+	write_stall_header();
+	if (ferror(stall_file) | fclose(stall_file))
+		fprintf(stderr, "Warning: could not write %s\n",
+			stall_file_name);
+	if (stall_file_dropped)
+		fprintf(stderr,
+			"Warning: %" PRIu64 " stalls lost before they were written to %s\n",
+			stall_file_dropped, stall_file_name);
+}
+
+/*
+ * Reporter thread, --interval
+ * Runs at normal priority on the housekeeping cpu and does all the
+ * printing while the test runs, so the measured cpus never do I/O.
+ */
+#define REPORTER_POLL_NSEC 50000000
+static void *reporter(void *arg)
+{
+	struct timespec poll = { 0, REPORTER_POLL_NSEC };
+	int n;
+
+	if (housekeeping_cpu >= 0 && jitterz_move_to_core(housekeeping_cpu) != 0)
+		fprintf(stderr,
+			"Warning: could not move reporter to cpu %d\n",
+			housekeeping_cpu);
+
+	while (!__atomic_load_n(&measurement_done, __ATOMIC_ACQUIRE)) {
+		if (config.interval && drain_intervals()) {
+			if (!interval_quiet)
+				report_interval_probes();
+			if (metrics_file)
+				write_metrics();
+		}
+		if (stall_file)
+			drain_stall_file();
+		nanosleep(&poll, NULL);
+	}
+	if (config.interval && drain_intervals()) {
+		if (!interval_quiet)
+			report_interval_probes();
+		if (metrics_file)
+			write_metrics();
+	}
+	if (stall_file)
+		close_stall_file();
+
+	for (n = 0; n < num_cpus && config.interval; n++)
+		if (jz->cpu_states[n].intervals->dropped)
+			fprintf(stderr,
+				"Warning: cpu %d dropped %" PRIu64 " interval reports\n",
+				jz->cpu_states[n].cpu,
+				jz->cpu_states[n].intervals->dropped);
+	return NULL;
+}
+
+/*
+ * Default housekeeping cpu: the first cpu we may run on that is not
+ * measured.  If every cpu is measured the reporter is left unpinned.
+ */
+static int pick_housekeeping_cpu(void)
+{
+	cpu_set_t allowed;
+	int c, n;
+
+	if (sched_getaffinity(0, sizeof(allowed), &allowed))
+		return -1;
+	for (n = 0; n < num_cpus; n++)
+		CPU_CLR(cpu_list[n], &allowed);
+	for (c = 0; c < CPU_SETSIZE; c++)
+		if (CPU_ISSET(c, &allowed))
+			return c;
+	return -1;
+}
+
+/*
+ * --audit
+ * Preflight check of how well the measured cpus are isolated.  Every
+ * check adds a result; the text report prints them as they come, json
+ * and csv carry them in the "audit" array.
+ */
+static struct audit_result {
+	int cpu; /* -1 for system wide checks */
+	const char *check;
+	bool ok;
+	char detail[160];
+} *audit_results;
+static int audit_count, audit_warnings;
+
+static void __attribute__((format(printf, 4, 5)))
+audit_add(int cpu, const char *check, bool ok, const char *fmt, ...)
+{
+	struct audit_result *r;
+	va_list ap;
+
+	audit_results = realloc(audit_results,
+				(audit_count + 1) * sizeof(*audit_results));
+	if (!audit_results) {
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+	r = &audit_results[audit_count++];
+	r->cpu = cpu;
+	r->check = check;
+	r->ok = ok;
+	va_start(ap, fmt);
+	vsnprintf(r->detail, sizeof(r->detail), fmt, ap);
+	va_end(ap);
+	if (!ok)
+		audit_warnings++;
+	if (output_format == OUTPUT_TEXT) {
+		if (cpu >= 0)
+			fprintf(stdout, "audit cpu %d : %s : %s : %s\n", cpu,
+				ok ? "ok" : "WARN", check, r->detail);
+		else
+			fprintf(stdout, "audit : %s : %s : %s\n",
+				ok ? "ok" : "WARN", check, r->detail);
+	}
+}
+
+/* First line of a small file without the newline, -1 if unreadable */
+static int read_line(const char *path, char *buf, int size)
+{
+	FILE *f = fopen(path, "r");
+	int len;
+
+	if (!f)
+		return -1;
+	if (!fgets(buf, size, f))
+		buf[0] = '\0';
+	fclose(f);
+	len = strlen(buf);
+	while (len && (buf[len - 1] == '\n' || buf[len - 1] == ' '))
+		buf[--len] = '\0';
+	return 0;
+}
+
+/* Is cpu in a cpu list such as "0-3,8,10-11" */
+static bool cpu_in_list(const char *list, int cpu)
+{
+	const char *p = list;
+
+	while (*p) {
+		char *end;
+		long first = strtol(p, &end, 10), last;
+
+		if (end == p)
+			return false;
+		last = first;
+		p = end;
+		if (*p == '-') {
+			last = strtol(p + 1, &end, 10);
+			p = end;
+		}
+		if (cpu >= first && cpu <= last)
+			return true;
+		if (*p != ',')
+			return false;
+		p++;
+	}
+	return false;
+}
+
+/* Value of a kernel command line parameter, empty if it is not given */
+static void cmdline_param(const char *name, char *value, int size)
+{
+	char cmdline[4096], *p, *end;
+	int len = strlen(name);
+
+	value[0] = '\0';
+	if (read_line("/proc/cmdline", cmdline, sizeof(cmdline)))
+		return;
+	/* init's arguments follow a lone "--" */
+	end = strstr(cmdline, " -- ");
+	if (end)
+		*end = '\0';
+	for (p = cmdline; (p = strstr(p, name)); p += len) {
+		if ((p != cmdline && p[-1] != ' ') || p[len] != '=')
+			continue;
+		snprintf(value, size, "%.*s", (int)strcspn(p + len + 1, " "),
+			 p + len + 1);
+		return;
+	}
+}
+
+/*
+ * The housekeeping flags of isolcpus= and nohz_full= may prefix the
+ * list, e.g. isolcpus=nohz,domain,2-7.  Skip to the list.
+ */
+static const char *skip_flags(const char *list)
+{
+	const char *p = list, *start = list;
+
+	while (*p) {
+		if (isalpha(*p)) {
+			p += strcspn(p, ",");
+			if (*p == ',')
+				p++;
+			start = p;
+		} else {
+			p += strcspn(p, ",");
+			if (*p == ',')
+				p++;
+		}
+	}
+	return start;
+}
+
+static void audit_isolation(int cpu)
+{
+	char buf[4096], param[1024];
+
+	if (read_line("/sys/devices/system/cpu/isolated", buf, sizeof(buf)))
+		buf[0] = '\0';
+	audit_add(cpu, "isolcpus", cpu_in_list(buf, cpu), "isolated cpus '%s'",
+		  buf);
+
+	if (read_line("/sys/devices/system/cpu/nohz_full", buf, sizeof(buf)) ||
+	    !strcmp(buf, "(null)"))
+		buf[0] = '\0';
+	audit_add(cpu, "nohz_full", cpu_in_list(buf, cpu),
+		  "nohz_full cpus '%s'", buf);
+
+	/* nohz_full cpus are rcu_nocbs too */
+	cmdline_param("rcu_nocbs", param, sizeof(param));
+	audit_add(cpu, "rcu_nocbs",
+		  cpu_in_list(skip_flags(param), cpu) || cpu_in_list(buf, cpu),
+		  "rcu_nocbs='%s'", param);
+}
+
+/* Interrupts whose affinity still lets them land on cpu */
+static void audit_irqs(int cpu)
+{
+	char path[300], list[1024], irqs[128] = "";
+	int count = 0, len = 0;
+	struct dirent *d;
+	DIR *dir = opendir("/proc/irq");
+
+	if (!dir) {
+		audit_add(cpu, "irq affinity", false, "can not read /proc/irq");
+		return;
+	}
+	while ((d = readdir(dir))) {
+		if (!isdigit(d->d_name[0]))
+			continue;
+		/* where it is routed now, else where it may be routed */
+		snprintf(path, sizeof(path),
+			 "/proc/irq/%s/effective_affinity_list", d->d_name);
+		if (read_line(path, list, sizeof(list)) || !list[0]) {
+			snprintf(path, sizeof(path),
+				 "/proc/irq/%s/smp_affinity_list", d->d_name);
+			if (read_line(path, list, sizeof(list)))
+				continue;
+		}
+		if (!cpu_in_list(list, cpu))
+			continue;
+		count++;
+		if (len < sizeof(irqs) - 16)
+			len += snprintf(irqs + len, sizeof(irqs) - len, "%s%s",
+					len ? "," : "", d->d_name);
+	}
+	closedir(dir);
+	audit_add(cpu, "irq affinity", !count, "%d irqs routed here%s%s",
+		  count, count ? ": " : "", irqs);
+}
+
+/*
+ * Tasks that may run on cpu.  Per cpu kernel threads bound to it (such as
+ * ksoftirqd/N) are expected and only counted; other tasks allowed on it
+ * and tasks runnable on it right now are flagged.
+ */
+#define PF_KTHREAD 0x00200000 /* flags of a kernel thread in stat */
+
+static void audit_tasks(int cpu)
+{
+	int bound = 0, allowed = 0, pinned = 0, runnable = 0;
+	char names[96] = "", pinned_names[96] = "";
+	int len = 0, pinned_len = 0;
+	bool smp = sysconf(_SC_NPROCESSORS_ONLN) > 1;
+	struct dirent *p;
+	DIR *proc = opendir("/proc");
+
+	if (!proc) {
+		audit_add(cpu, "tasks", false, "can not read /proc");
+		return;
+	}
+	while ((p = readdir(proc))) {
+		char path[600], line[512];
+		struct dirent *t;
+		DIR *task;
+
+		if (!isdigit(p->d_name[0]) || atoi(p->d_name) == getpid())
+			continue;
+		snprintf(path, sizeof(path), "/proc/%s/task", p->d_name);
+		task = opendir(path);
+		if (!task)
+			continue;
+		while ((t = readdir(task))) {
+			char comm[64] = "", list[1024] = "";
+			char state = 0;
+			int on_cpu = -1, ppid = -1;
+			unsigned int flags = 0;
+			bool kthread, single;
+			FILE *f;
+
+			if (!isdigit(t->d_name[0]))
+				continue;
+			snprintf(path, sizeof(path), "/proc/%s/task/%s/status",
+				 p->d_name, t->d_name);
+			f = fopen(path, "r");
+			if (!f)
+				continue;
+			while (fgets(line, sizeof(line), f)) {
+				if (!strncmp(line, "Name:", 5))
+					sscanf(line + 5, "%63s", comm);
+				else if (!strncmp(line, "Cpus_allowed_list:", 18))
+					sscanf(line + 18, "%1023s", list);
+			}
+			fclose(f);
+
+			/*
+			 * state is field 3, ppid 4, flags 9 and the last cpu
+			 * field 39 of stat
+			 */
+			snprintf(path, sizeof(path), "/proc/%s/task/%s/stat",
+				 p->d_name, t->d_name);
+			if (!read_line(path, line, sizeof(line))) {
+				char *s = strrchr(line, ')');
+				int field;
+
+				/* leaves s on the space before field 39 */
+				if (s && sscanf(s + 2, "%c %d %*d %*d %*d %*d %u",
+						&state, &ppid, &flags) == 3)
+					for (field = 3; s && field <= 39; field++)
+						s = strchr(s + 1, ' ');
+				else
+					s = NULL;
+				if (s)
+					on_cpu = atoi(s + 1);
+			}
+			kthread = flags & PF_KTHREAD || ppid == 2 ||
+				  atoi(p->d_name) == 2;
+
+			if (!cpu_in_list(list, cpu))
+				continue;
+			if (state == 'R' && on_cpu == cpu)
+				runnable++;
+			single = !strchr(list, ',') && !strchr(list, '-');
+			/* per cpu kernel threads are expected here */
+			if (single && kthread) {
+				bound++;
+				continue;
+			}
+			/* on one cpu every task is pinned to it */
+			if (single && smp) {
+				pinned++;
+				if (pinned_len < sizeof(pinned_names) - 20)
+					pinned_len += snprintf(
+						pinned_names + pinned_len,
+						sizeof(pinned_names) - pinned_len,
+						"%s%s", pinned_len ? "," : "",
+						comm);
+				continue;
+			}
+			allowed++;
+			if (len < sizeof(names) - 20)
+				len += snprintf(names + len, sizeof(names) - len,
+						"%s%s", len ? "," : "", comm);
+		}
+		closedir(task);
+	}
+	closedir(proc);
+	audit_add(cpu, "tasks", !allowed,
+		  "%d tasks may run here%s%s, %d bound per cpu threads",
+		  allowed, allowed ? ": " : "", names, bound);
+	audit_add(cpu, "pinned tasks", !pinned,
+		  "%d user tasks pinned here%s%s", pinned, pinned ? ": " : "",
+		  pinned_names);
+	audit_add(cpu, "runnable", !runnable, "%d other tasks runnable here",
+		  runnable);
+}
+
+static void audit_cpu_state(int cpu)
+{
+	char path[256], buf[256];
+	int i, deep = 0;
+
+	snprintf(path, sizeof(path),
+		 "/sys/devices/system/cpu/cpu%d/topology/thread_siblings_list",
+		 cpu);
+	if (!read_line(path, buf, sizeof(buf))) {
+		char isolated[4096];
+		bool busy_sibling = false;
+		int c;
+
+		if (read_line("/sys/devices/system/cpu/isolated", isolated,
+			      sizeof(isolated)))
+			isolated[0] = '\0';
+		for (c = 0; c < CPU_SETSIZE; c++)
+			if (c != cpu && cpu_in_list(buf, c) &&
+			    !cpu_in_list(isolated, c))
+				busy_sibling = true;
+		audit_add(cpu, "smt sibling", !busy_sibling,
+			  "siblings '%s'%s", buf,
+			  busy_sibling ? ", a sibling is online and not isolated" :
+					 "");
+	}
+
+	snprintf(path, sizeof(path),
+		 "/sys/devices/system/cpu/cpu%d/cpufreq/scaling_governor", cpu);
+	if (read_line(path, buf, sizeof(buf)))
+		audit_add(cpu, "cpufreq governor", true, "no cpufreq");
+	else
+		audit_add(cpu, "cpufreq governor", !strcmp(buf, "performance"),
+			  "%s", buf);
+
+	/* enabled idle states that take more than a few usec to leave */
+	for (i = 0;; i++) {
+		char name[64], disable[16], latency[32];
+
+		snprintf(path, sizeof(path),
+			 "/sys/devices/system/cpu/cpu%d/cpuidle/state%d/name",
+			 cpu, i);
+		if (read_line(path, name, sizeof(name)))
+			break;
+		snprintf(path, sizeof(path),
+			 "/sys/devices/system/cpu/cpu%d/cpuidle/state%d/disable",
+			 cpu, i);
+		if (read_line(path, disable, sizeof(disable)))
+			disable[0] = '0';
+		snprintf(path, sizeof(path),
+			 "/sys/devices/system/cpu/cpu%d/cpuidle/state%d/latency",
+			 cpu, i);
+		if (read_line(path, latency, sizeof(latency)))
+			continue;
+		if (disable[0] == '0' && atoi(latency) > 10) {
+			deep++;
+			audit_add(cpu, "cpuidle", false,
+				  "%s enabled, exit latency %s usec", name,
+				  latency);
+		}
+	}
+	if (!deep)
+		audit_add(cpu, "cpuidle", true, "no deep idle states enabled");
+}
+
+static void run_audit(void)
+{
+	char buf[64];
+	int n;
+
+	for (n = 0; n < num_cpus; n++) {
+		audit_isolation(cpu_list[n]);
+		audit_irqs(cpu_list[n]);
+		audit_tasks(cpu_list[n]);
+		audit_cpu_state(cpu_list[n]);
+	}
+	if (!read_line("/proc/sys/kernel/sched_rt_runtime_us", buf,
+		       sizeof(buf)))
+		audit_add(-1, "rt throttling", atoi(buf) == -1,
+			  "sched_rt_runtime_us %s%s", buf,
+			  atoi(buf) == -1 ? "" :
+					    ", fifo/rr threads are throttled");
+	if (output_format == OUTPUT_TEXT)
+		fprintf(stdout, "audit : %d warnings\n", audit_warnings);
+}
+
+/* Print stall percentiles from the --hdr histograms, one column per cpu */
+static void print_percentiles(void)
+{
+	int i, n;
+
+	/* timer and memory mode record every wakeup or iteration */
+	if (config.mode == JITTERZ_MODE_TIMER)
+		fprintf(stdout, "wakeup latency percentiles (usec)\nwakeups :");
+	else if (config.mode == JITTERZ_MODE_MEMORY)
+		fprintf(stdout, "iteration percentiles (usec)\niterations :");
+	else
+		fprintf(stdout, "stall percentiles (usec)\nstalls :");
+	for (n = 0; n < num_cpus; n++)
+		fprintf(stdout, " %" PRIu64, jz->cpu_states[n].hdr.total);
+	fprintf(stdout, "\n");
+	for (i = 0; i < NUMBER_PERCENTILES; i++) {
+		fprintf(stdout, "p%g :", percentiles[i]);
+		for (n = 0; n < num_cpus; n++) {
+			struct cpu_state *s = &jz->cpu_states[n];
+
+			fprintf(stdout, " %.3f",
+				jitterz_hdr_percentile(&s->hdr,
+						       percentiles[i]) *
+					1e6 / s->frequency);
+		}
+		fprintf(stdout, "\n");
+	}
+	fprintf(stdout, "max :");
+	for (n = 0; n < num_cpus; n++)
+		fprintf(stdout, " %.3f", jz->cpu_states[n].hdr.max * 1e6 /
+						 jz->cpu_states[n].frequency);
+	fprintf(stdout, "\n");
+}
+
+/* The --fine histogram, rows no cpu has a delta in left out */
+static void print_fine(void)
+{
+	struct jitterz_snapshot snap[num_cpus];
+	int i, n;
+
+	for (n = 0; n < num_cpus; n++)
+		jitterz_snapshot(jz, n, &snap[n]);
+	fprintf(stdout, "loop deltas (nsec) : count\n");
+	for (i = 0; i < FINE_BUCKETS; i++) {
+		uint64_t total = 0;
+
+		for (n = 0; n < num_cpus; n++)
+			total += snap[n].fine_counts[i];
+		if (!total)
+			continue;
+		/* the last bucket holds what the --fine range clamps */
+		if (i == FINE_BUCKETS - 1)
+			fprintf(stdout, ">= %.1f :", (double)config.fine_ns);
+		else
+			fprintf(stdout, "%.1f :", i * snap[0].fine_width_ns);
+		for (n = 0; n < num_cpus; n++)
+			fprintf(stdout, " %" PRIu64, snap[n].fine_counts[i]);
+		fprintf(stdout, "\n");
+	}
+}
+
+/* --correlate, one column per cpu */
+static void print_stall_classes(void)
+{
+	struct jitterz_snapshot snap[num_cpus];
+	int n;
+
+	for (n = 0; n < num_cpus; n++)
+		jitterz_snapshot(jz, n, &snap[n]);
+	fprintf(stdout, "global events (stalls on %d or more cpus at once) : %" PRIu64 "\n",
+		config.correlate, jz->global_events);
+	fprintf(stdout, "global stalls :");
+	for (n = 0; n < num_cpus; n++)
+		fprintf(stdout, " %" PRIu64, snap[n].global_stalls);
+	fprintf(stdout, "\nglobal lost time (sec) :");
+	for (n = 0; n < num_cpus; n++)
+		fprintf(stdout, " %f", snap[n].global_lost_s);
+	fprintf(stdout, "\nlocal stalls :");
+	for (n = 0; n < num_cpus; n++)
+		fprintf(stdout, " %" PRIu64, snap[n].local_stalls);
+	fprintf(stdout, "\nlocal lost time (sec) :");
+	for (n = 0; n < num_cpus; n++)
+		fprintf(stdout, " %f", snap[n].local_lost_s);
+	fprintf(stdout, "\n");
+	for (n = 0; n < num_cpus; n++)
+		if (snap[n].stalls > snap[n].global_stalls + snap[n].local_stalls)
+			fprintf(stdout,
+				"cpu %d: %" PRIu64 " older stalls not classified, the stall log was full\n",
+				snap[n].cpu,
+				snap[n].stalls - snap[n].global_stalls -
+					snap[n].local_stalls);
+}
+
+/* CLOCK_REALTIME nsec as UTC, e.g. 2020-04-01T12:00:00.000123456Z */
+static void format_realtime(uint64_t ns, char *buf, size_t len)
+{
+	time_t sec = ns / NSEC_PER_SEC;
+	struct tm tm;
+	size_t n;
+
+	gmtime_r(&sec, &tm);
+	n = strftime(buf, len, "%Y-%m-%dT%H:%M:%S", &tm);
+	snprintf(buf + n, len - n, ".%09" PRIu64 "Z", ns % NSEC_PER_SEC);
+}
+
+/* --daemon, the lost time of the rolling windows when it was stopped */
+static void print_windows(void)
+{
+	size_t w;
+	int n;
+
+	fprintf(stdout, "window : lost time (sec) \n");
+	for (w = 0; w < NUMBER_WINDOWS; w++) {
+		fprintf(stdout, "%s :", windows[w].name);
+		for (n = 0; n < num_cpus; n++) {
+			const struct interval_sample *now =
+				&probes[n].last_interval;
+			const struct interval_sample *base = window_base(
+				&probes[n].history,
+				now->second - windows[w].seconds);
+
+			fprintf(stdout, " %f",
+				(double)(now->lost_ticks - base->lost_ticks) /
+					jz->frequency);
+		}
+		fprintf(stdout, "\n");
+	}
+}
+
+/*
+ * The --top longest stalls of all cpus, longest first, in an array to
+ * free.  NULL and a count of 0 if they could not be had.
+ */
+static struct jitterz_stall *longest_stalls(int *count)
+{
+	struct jitterz_stall *stalls;
+
+	*count = 0;
+	stalls = calloc(config.top_stalls, sizeof(*stalls));
+	if (!stalls) {
+		fprintf(stderr, "Warning: no memory for the longest stalls\n");
+		return NULL;
+	}
+	*count = jitterz_longest_stalls(jz, stalls, config.top_stalls);
+	if (*count < 0) {
+		fprintf(stderr, "Warning: %s\n", jitterz_error(jz));
+		*count = 0;
+	}
+	return stalls;
+}
+
+/* The --top longest stalls of all cpus, longest first */
+static void print_longest_stalls(void)
+{
+	struct jitterz_stall *stalls;
+	int count, i;
+
+	stalls = longest_stalls(&count);
+	fprintf(stdout, "longest stalls (cpu : start UTC : stall usec)\n");
+	for (i = 0; i < count; i++) {
+		char when[64];
+
+		format_realtime(stalls[i].realtime_ns, when, sizeof(when));
+		fprintf(stdout, "%d : %s : %.3f\n", stalls[i].cpu, when,
+			stalls[i].ns / 1000.);
+	}
+	free(stalls);
+}
+
+/* Print the stall ring of every cpu, oldest stall first */
+static void print_stall_log(void)
+{
+	int n;
+
+	fprintf(stdout, "stall log (cpu : usec since start : stall usec)\n");
+	for (n = 0; n < num_cpus; n++) {
+		struct cpu_state *s = &jz->cpu_states[n];
+		uint64_t size = s->stall_mask + 1;
+		uint64_t first = 0, i;
+
+		if (s->stall_count > size) {
+			first = s->stall_count - size;
+			fprintf(stdout, "cpu %d: %" PRIu64 " older stalls dropped\n",
+				s->cpu, first);
+		}
+		for (i = first; i < s->stall_count; i++) {
+			struct stall_record *r = &s->stalls[i & s->stall_mask];
+			double at = (r->start_tick - s->test_tick_start) * 1e6 /
+				    s->frequency;
+			double len = r->ticks * 1e6 / s->frequency;
+
+			fprintf(stdout, "%d : %.3f : %.3f\n", r->cpu, at, len);
+		}
+	}
+}
+
+/* Smallest and typical delta between reads of the busy or memory loop */
+static void print_loop_deltas(void)
+{
+	int n;
+
+	fprintf(stdout, "min delta (nsec) :");
+	for (n = 0; n < num_cpus; n++) {
+		struct jitterz_snapshot snap;
+
+		jitterz_snapshot(jz, n, &snap);
+		fprintf(stdout, " %.1f", snap.min_delta_ns);
+	}
+	fprintf(stdout, "\ntypical delta (nsec) :");
+	for (n = 0; n < num_cpus; n++) {
+		struct jitterz_snapshot snap;
+
+		jitterz_snapshot(jz, n, &snap);
+		fprintf(stdout, " %.1f", snap.typical_delta_ns);
+	}
+	fprintf(stdout, "\n");
+}
+
+/* The classic free form report */
+static void print_text_report(double real_duration)
+{
+	int i, n;
+
+	fprintf(stdout, "cutoff time (usec) : %s \n",
+		config.mode == JITTERZ_MODE_MEMORY ? "iterations over cutoff" :
+						     "stall count");
+	if (num_cpus > 1) {
+		fprintf(stdout, "cpu               :");
+		for (n = 0; n < num_cpus; n++)
+			fprintf(stdout, " %" PRIu64, (uint64_t)jz->cpu_states[n].cpu);
+		fprintf(stdout, "\n");
+	}
+	for (i = 0; i < NUMBER_BUCKETS; i++) {
+		struct bucket *b = jz->cpu_states[0].b;
+		double t = b[i].time_boundry / 1000000000.; /* sec */
+		if (t < real_duration) {
+			double tb = b[i].time_boundry; /* nsec */
+			fprintf(stdout, "%.1f :", tb / 1000.);
+			for (n = 0; n < num_cpus; n++)
+				fprintf(stdout, " %" PRIu64,
+					jz->cpu_states[n].b[i].count);
+			fprintf(stdout, "\n");
+		}
+	}
+
+	/* what the loop itself costs, the floor of what it can see */
+	fprintf(stdout, "iterations :");
+	for (n = 0; n < num_cpus; n++)
+		fprintf(stdout, " %" PRIu64, jz->cpu_states[n].iterations);
+	fprintf(stdout, "\nsamples/sec :");
+	for (n = 0; n < num_cpus; n++) {
+		struct jitterz_snapshot snap;
+
+		jitterz_snapshot(jz, n, &snap);
+		fprintf(stdout, " %.0f", snap.samples_per_s);
+	}
+	fprintf(stdout, "\n");
+
+	/* a timer mode iteration is a period, not a loop delta */
+	if (config.mode != JITTERZ_MODE_TIMER)
+		print_loop_deltas();
+
+	for (n = 0; n < num_cpus; n++) {
+		struct cpu_state *s = &jz->cpu_states[n];
+
+		if (num_cpus > 1)
+			printf("cpu %d: ", s->cpu);
+		/* what was measured, --breaktrace or a signal may end early */
+		printf("%s %f out of %.3f seconds\n",
+		       config.mode == JITTERZ_MODE_MEMORY ?
+			       "Time in iterations over cutoff" :
+			       "Lost time",
+		       (double)s->accumulated_lost_ticks /
+			       (double)s->frequency,
+		       s->real_duration);
+	}
+
+	if (config.hdr_digits)
+		print_percentiles();
+	if (config.fine_ns)
+		print_fine();
+	if (irq_stats) {
+		print_irq_delta(stdout, "interrupts", &irqs_start, &irqs_end);
+		print_irq_delta(stdout, "softirqs", &softirqs_start,
+				&softirqs_end);
+	}
+	if (smi_stats) {
+		fprintf(stdout, "smi count :");
+		for (n = 0; n < num_cpus; n++)
+			fprintf(stdout, " %" PRIu64,
+				probes[n].smi_end - probes[n].smi_start);
+		fprintf(stdout, "\n");
+	}
+	if (perf_stats) {
+		fprintf(stdout, "perf events on measured cpus (event : count per cpu)\n");
+		for (i = 0; i < NUMBER_PERF_EVENTS; i++) {
+			if (probes[0].perf_fd[i] < 0)
+				continue;
+			fprintf(stdout, "%s :", perf_events[i].name);
+			for (n = 0; n < num_cpus; n++)
+				fprintf(stdout, " %" PRIu64,
+					probes[n].perf_end[i] -
+						probes[n].perf_start[i]);
+			fprintf(stdout, "\n");
+		}
+	}
+	if (jz->breaktrace_hit)
+		fprintf(stdout,
+			"breaktrace: cpu %d stalled %.3f usec at %.3f usec, tracing stopped\n",
+			jz->breaktrace_stall.cpu,
+			jz->breaktrace_stall.ticks * 1e6 / jz->frequency,
+			(jz->breaktrace_stall.start_tick -
+			 jz->cpu_states[0].test_tick_start) * 1e6 / jz->frequency);
+	if (config.stall_log && !stall_log_quiet)
+		print_stall_log();
+	if (config.top_stalls)
+		print_longest_stalls();
+	if (config.correlate)
+		print_stall_classes();
+	if (daemon_mode)
+		print_windows();
+}
+
+/*
+ * Structured report writer for --output=json and --output=csv.
+ * json nests objects and arrays.  csv flattens every value to one
+ * "key,value" row where the key joins the names and array indexes of
+ * everything above it with dots, e.g. cpus.0.buckets.3.count.
+ */
+#define EMIT_MAX_DEPTH 8
+#define EMIT_MAX_PATH 256
+static struct emit_level {
+	bool array;
+	int count; /* members emitted so far */
+	int path_len; /* csv, length of the key prefix of this level */
+} emit_stack[EMIT_MAX_DEPTH];
+static int emit_depth;
+static char emit_path[EMIT_MAX_PATH];
+
+/*
+ * Start a member of the current level.  Prints the json separator and
+ * name, or builds the csv key for it in emit_path.
+ */
+static void emit_member(const char *key)
+{
+	struct emit_level *l = &emit_stack[emit_depth];
+	int len = l->path_len;
+
+	if (output_format == OUTPUT_JSON) {
+		fprintf(stdout, "%s\n%*s", l->count ? "," : "",
+			2 * (emit_depth + 1), "");
+		if (!l->array)
+			fprintf(stdout, "\"%s\": ", key);
+	} else {
+		if (l->array)
+			snprintf(emit_path + len, EMIT_MAX_PATH - len, "%s%d",
+				 len ? "." : "", l->count);
+		else
+			snprintf(emit_path + len, EMIT_MAX_PATH - len, "%s%s",
+				 len ? "." : "", key);
+	}
+	l->count++;
+}
+
+static void emit_begin(const char *key, bool array)
+{
+	struct emit_level *l;
+
+	if (emit_depth + 1 >= EMIT_MAX_DEPTH) {
+		fprintf(stderr, "Report nested too deep\n");
+		exit(1);
+	}
+	emit_member(key);
+	if (output_format == OUTPUT_JSON)
+		fprintf(stdout, array ? "[" : "{");
+	l = &emit_stack[++emit_depth];
+	l->array = array;
+	l->count = 0;
+	l->path_len = strlen(emit_path);
+}
+
+static void emit_end(void)
+{
+	struct emit_level *l = &emit_stack[emit_depth--];
+
+	if (output_format == OUTPUT_JSON)
+		fprintf(stdout, "%s%*s%s", l->count ? "\n" : "",
+			l->count ? 2 * (emit_depth + 1) : 0, "",
+			l->array ? "]" : "}");
+	emit_path[emit_stack[emit_depth].path_len] = '\0';
+}
+
+static void emit_u64(const char *key, uint64_t value)
+{
+	emit_member(key);
+	if (output_format == OUTPUT_JSON)
+		fprintf(stdout, "%" PRIu64, value);
+	else
+		fprintf(stdout, "%s,%" PRIu64 "\n", emit_path, value);
+}
+
+static void emit_int(const char *key, int value)
+{
+	emit_member(key);
+	if (output_format == OUTPUT_JSON)
+		fprintf(stdout, "%d", value);
+	else
+		fprintf(stdout, "%s,%d\n", emit_path, value);
+}
+
+static void emit_double(const char *key, double value)
+{
+	emit_member(key);
+	if (output_format == OUTPUT_JSON)
+		fprintf(stdout, "%.9g", value);
+	else
+		fprintf(stdout, "%s,%.9g\n", emit_path, value);
+}
+
+/*
+ * Quote value for json, or for csv when it holds a comma or a quote.
+ * NULL, such as the frequency source of --audit-only, is json null.
+ */
+static void emit_string(const char *key, const char *value)
+{
+	const char *p;
+
+	emit_member(key);
+	if (!value) {
+		if (output_format == OUTPUT_JSON)
+			fprintf(stdout, "null");
+		else
+			fprintf(stdout, "%s,\n", emit_path);
+		return;
+	}
+	if (output_format == OUTPUT_CSV) {
+		fprintf(stdout, "%s,", emit_path);
+		if (!strpbrk(value, ",\"")) {
+			fprintf(stdout, "%s\n", value);
+			return;
+		}
+	}
+	fputc('"', stdout);
+	for (p = value; *p; p++) {
+		if (*p == '"')
+			fputc(output_format == OUTPUT_JSON ? '\\' : '"', stdout);
+		else if (*p == '\\' && output_format == OUTPUT_JSON)
+			fputc('\\', stdout);
+		fputc(*p, stdout);
+	}
+	fprintf(stdout, output_format == OUTPUT_JSON ? "\"" : "\"\n");
+}
+
+static void emit_bool(const char *key, bool value)
+{
+	emit_member(key);
+	if (output_format == OUTPUT_JSON)
+		fprintf(stdout, value ? "true" : "false");
+	else
+		fprintf(stdout, "%s,%d\n", emit_path, value);
+}
+
+static const char *time_source_name(void)
+{
+	switch (config.time_source) {
+	case JITTERZ_TS_RDTSC:
+		return "rdtsc";
+	case JITTERZ_TS_RDTSCP:
+		return "rdtscp";
+	case JITTERZ_TS_CNTVCT:
+		return "cntvct";
+	default:
+		return "clock_gettime";
+	}
+}
+
+static const char *mode_name(void)
+{
+	switch (config.mode) {
+	case JITTERZ_MODE_TIMER:
+		return "timer";
+	case JITTERZ_MODE_MEMORY:
+		return "memory";
+	default:
+		return "busy";
+	}
+}
+
+static void emit_config(void)
+{
+	int n;
+
+	emit_begin("config", false);
+	emit_begin("cpus", true);
+	for (n = 0; n < num_cpus; n++)
+		emit_int(NULL, cpu_list[n]);
+	emit_end();
+	emit_string("policy", jitterz_policy_name(config.policy));
+	emit_int("priority", config.priority);
+	if (config.policy == SCHED_DEADLINE) {
+		emit_u64("dl_runtime_ns", config.dl_runtime_ns);
+		emit_u64("dl_deadline_ns", config.dl_deadline_ns);
+		emit_u64("dl_period_ns", config.dl_period_ns);
+	}
+	emit_string("time_source", time_source_name());
+	emit_string("clock", jitterz_clocks[clocksel].name);
+	emit_u64("frequency_hz", jz->frequency);
+	emit_string("frequency_source", jz->frequency_source);
+	emit_u64("threshold_ns", config.threshold_ns);
+	emit_int("duration_s", run_time);
+	emit_int("interval_s", config.interval);
+	emit_string("mode", mode_name());
+	if (config.mode == JITTERZ_MODE_TIMER)
+		emit_u64("period_ns", config.period_ns);
+	if (config.mode == JITTERZ_MODE_MEMORY) {
+		emit_u64("working_set_bytes", jz->wss);
+		emit_string("access", config.access == JITTERZ_ACCESS_CHASE ?
+					      "chase" : "stream");
+		emit_int("accesses", config.accesses);
+	}
+	emit_u64("tracemark_ns", config.tracemark_ns);
+	emit_u64("breaktrace_ns", config.breaktrace_ns);
+	emit_u64("fine_ns", config.fine_ns);
+	emit_int("top_stalls", config.top_stalls);
+	emit_int("correlate", config.correlate);
+	emit_end();
+
+	emit_begin("clocks", true);
+	for (n = 0; n < NUMBER_CLOCKS; n++) {
+		emit_begin(NULL, false);
+		emit_string("name", jitterz_clocks[n].name);
+		emit_bool("supported", jz->clock_costs[n].supported);
+		emit_double("ns_per_call", jz->clock_costs[n].ns_per_call);
+		emit_int("resolution_ns", jz->clock_costs[n].resolution_ns);
+		emit_end();
+	}
+	emit_end();
+}
+
+/* Lines of an irq snapshot pair that fired on measured cpu n */
+static void emit_irqs(const char *key, int n,
+		      const struct irq_snapshot *before,
+		      const struct irq_snapshot *after)
+{
+	int i;
+
+	emit_begin(key, true);
+	for (i = 0; i < after->nlines; i++) {
+		struct irq_line *l = &after->lines[i];
+		uint64_t delta = irq_delta(irq_match(before, after, i), l, n);
+
+		if (!delta)
+			continue;
+		emit_begin(NULL, false);
+		emit_string("name", l->name);
+		emit_string("description", l->desc);
+		emit_u64("count", delta);
+		emit_end();
+	}
+	emit_end();
+}
+
+static void emit_cpu(struct cpu_state *s, int n)
+{
+	struct cpu_probes *p = &probes[n];
+	double ns_per_tick = 1e9 / s->frequency;
+	struct jitterz_snapshot snap;
+	char name[16];
+	int i;
+
+	jitterz_snapshot(jz, n, &snap);
+	emit_begin(NULL, false);
+	emit_int("cpu", s->cpu);
+	emit_u64("iterations", s->iterations);
+	emit_double("duration_s", s->real_duration);
+	emit_double("samples_per_s", snap.samples_per_s);
+	if (config.mode != JITTERZ_MODE_TIMER) {
+		emit_double("min_delta_ns", snap.min_delta_ns);
+		emit_double("typical_delta_ns", snap.typical_delta_ns);
+	}
+	emit_double("lost_time_s",
+		    (double)s->accumulated_lost_ticks / s->frequency);
+
+	emit_begin("buckets", true);
+	for (i = 0; i < NUMBER_BUCKETS; i++) {
+		emit_begin(NULL, false);
+		emit_u64("cutoff_ns", s->b[i].time_boundry);
+		emit_u64("count", s->b[i].count);
+		emit_end();
+	}
+	emit_end();
+
+	if (s->hdr.counts) {
+		emit_begin("percentiles_ns", false);
+		emit_u64(config.mode == JITTERZ_MODE_TIMER ? "wakeups" :
+			 config.mode == JITTERZ_MODE_MEMORY ? "iterations" :
+			 "stalls",
+			 s->hdr.total);
+		for (i = 0; i < NUMBER_PERCENTILES; i++) {
+			snprintf(name, sizeof(name), "p%g", percentiles[i]);
+			emit_double(name, jitterz_hdr_percentile(&s->hdr,
+								 percentiles[i]) *
+						  ns_per_tick);
+		}
+		emit_double("max", s->hdr.max * ns_per_tick);
+		emit_end();
+	}
+	if (daemon_mode) {
+		emit_begin("windows", true);
+		for (i = 0; i < (int)NUMBER_WINDOWS; i++) {
+			const struct interval_sample *base = window_base(
+				&p->history,
+				p->last_interval.second - windows[i].seconds);
+
+			emit_begin(NULL, false);
+			emit_string("window", windows[i].name);
+			emit_int("seconds", p->last_interval.second - base->second);
+			emit_double("lost_s", (double)(p->last_interval.lost_ticks -
+						       base->lost_ticks) /
+						      s->frequency);
+			emit_end();
+		}
+		emit_end();
+	}
+	if (config.correlate) {
+		emit_begin("stall_classes", false);
+		emit_u64("global_stalls", snap.global_stalls);
+		emit_double("global_lost_s", snap.global_lost_s);
+		emit_u64("global_events", snap.global_events);
+		emit_u64("local_stalls", snap.local_stalls);
+		emit_double("local_lost_s", snap.local_lost_s);
+		emit_end();
+	}
+	if (config.fine_ns) {
+		emit_begin("loop_deltas", false);
+		emit_double("width_ns", snap.fine_width_ns);
+		emit_begin("counts", true);
+		for (i = 0; i < FINE_BUCKETS; i++)
+			emit_u64(NULL, snap.fine_counts[i]);
+		emit_end();
+		emit_end();
+	}
+
+	if (smi_stats)
+		emit_u64("smi_count", p->smi_end - p->smi_start);
+	if (perf_stats) {
+		emit_begin("perf", false);
+		for (i = 0; i < NUMBER_PERF_EVENTS; i++)
+			if (p->perf_fd[i] >= 0)
+				emit_u64(perf_events[i].name,
+					 p->perf_end[i] - p->perf_start[i]);
+		emit_end();
+	}
+	if (irq_stats) {
+		emit_irqs("interrupts", n, &irqs_start, &irqs_end);
+		emit_irqs("softirqs", n, &softirqs_start, &softirqs_end);
+	}
+
+	if (config.stall_log && !stall_log_quiet) {
+		uint64_t size = s->stall_mask + 1;
+		uint64_t first = s->stall_count > size ?
+					 s->stall_count - size : 0;
+		uint64_t j;
+
+		emit_u64("stalls_dropped", first);
+		emit_begin("stalls", true);
+		for (j = first; j < s->stall_count; j++) {
+			struct stall_record *r = &s->stalls[j & s->stall_mask];
+
+			emit_begin(NULL, false);
+			emit_double("start_ns", (r->start_tick -
+						 s->test_tick_start) *
+							ns_per_tick);
+			emit_double("length_ns", r->ticks * ns_per_tick);
+			emit_end();
+		}
+		emit_end();
+	}
+	emit_end();
+}
+
+/*
+ * --output=json|csv
+ * The schema is versioned; fields are only ever added.
+ */
+#define REPORT_VERSION 1
+static void emit_report(double real_duration)
+{
+	int n;
+
+	if (output_format == OUTPUT_JSON)
+		fprintf(stdout, "{");
+	else
+		fprintf(stdout, "key,value\n");
+	emit_depth = 0;
+	emit_stack[0].array = false;
+	emit_stack[0].count = 0;
+	emit_stack[0].path_len = 0;
+
+	emit_int("version", REPORT_VERSION);
+	emit_config();
+	if (audit) {
+		emit_begin("audit", true);
+		for (n = 0; n < audit_count; n++) {
+			emit_begin(NULL, false);
+			emit_int("cpu", audit_results[n].cpu);
+			emit_string("check", audit_results[n].check);
+			emit_bool("ok", audit_results[n].ok);
+			emit_string("detail", audit_results[n].detail);
+			emit_end();
+		}
+		emit_end();
+		/* --audit-only, nothing was measured */
+		if (audit > 1)
+			goto out;
+	}
+	emit_double("run_duration_s", real_duration);
+	if (jz->breaktrace_hit) {
+		emit_begin("breaktrace", false);
+		emit_int("cpu", jz->breaktrace_stall.cpu);
+		emit_double("length_ns",
+			    jz->breaktrace_stall.ticks * 1e9 / jz->frequency);
+		emit_double("start_ns", (jz->breaktrace_stall.start_tick -
+					 jz->cpu_states[0].test_tick_start) *
+						1e9 / jz->frequency);
+		emit_end();
+	}
+	if (config.correlate)
+		emit_u64("global_events", jz->global_events);
+	emit_begin("cpus", true);
+	for (n = 0; n < num_cpus; n++)
+		emit_cpu(&jz->cpu_states[n], n);
+	emit_end();
+	if (config.top_stalls) {
+		int count;
+		struct jitterz_stall *stalls = longest_stalls(&count);
+
+		emit_begin("longest_stalls", true);
+		for (n = 0; n < count; n++) {
+			char when[64];
+
+			format_realtime(stalls[n].realtime_ns, when,
+					sizeof(when));
+			emit_begin(NULL, false);
+			emit_int("cpu", stalls[n].cpu);
+			emit_string("start", when);
+			emit_u64("start_realtime_ns", stalls[n].realtime_ns);
+			emit_u64("length_ns", stalls[n].ns);
+			emit_end();
+		}
+		emit_end();
+		free(stalls);
+	}
+
+out:
+	if (output_format == OUTPUT_JSON)
+		fprintf(stdout, "\n}\n");
+}
+
+/* --stall-file, the header without the anchor yet */
+static void start_stall_file(void)
+{
+	const char *clock = config.time_source == JITTERZ_TS_GETTIME ?
+				    jitterz_clocks[clocksel].name :
+				    time_source_name();
+	int n;
+
+	stall_header_size = (sizeof(*stall_header) +
+			     num_cpus * sizeof(stall_header->cpus[0]) + 7) & ~7;
+	stall_header = calloc(1, stall_header_size);
+	stall_buf = malloc((jz->cpu_states[0].stall_mask + 1) *
+			   sizeof(*stall_buf));
+	if (!stall_header || !stall_buf) {
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+	memcpy(stall_header->magic, JITTERZ_STALL_FILE_MAGIC,
+	       sizeof(stall_header->magic));
+	stall_header->version = JITTERZ_STALL_FILE_VERSION;
+	stall_header->records_offset = stall_header_size;
+	stall_header->frequency = jz->frequency;
+	stall_header->threshold_ns = config.threshold_ns;
+	snprintf(stall_header->clock, sizeof(stall_header->clock), "%s",
+		 clock);
+	stall_header->nr_cpus = num_cpus;
+	for (n = 0; n < num_cpus; n++)
+		stall_header->cpus[n] = cpu_list[n];
+	write_stall_header();
+}
+
+/*
+ * --daemon runs until it is told to stop, then reports as usual.  Any
+ * run that leaves something behind, e.g. the --shm segment, stops the
+ * same way so jitterz_destroy() cleans up.
+ */
+static volatile sig_atomic_t stop_requested;
+
+static void stop_handler(int sig)
+{
+	stop_requested = 1;
+	jitterz_stop(jz);
+}
+
+/* Exit on an error once jz is configured, without leaving it behind */
+static void __attribute__((noreturn)) fail_exit(bool reporter_running)
+{
+	if (reporter_running) {
+		__atomic_store_n(&measurement_done, 1, __ATOMIC_RELEASE);
+		pthread_join(reporter_thread, NULL);
+	}
+	jitterz_destroy(jz);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	long max_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	double real_duration = 0.0; /* sec */
+	int n;
+
+	jitterz_default_config(&config);
+	process_options(argc, argv, max_cpus);
+	config.cpus = cpu_list;
+	config.nr_cpus = num_cpus;
+	config.clock = jitterz_clocks[clocksel].id;
+	config.wss = wss_arg;
+	progress = output_format == OUTPUT_TEXT ? stdout : stderr;
+
+	if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0) {
+		fprintf(stderr, "Error while locking process memory\n");
+		exit(1);
+	}
+
+	if (bench_record) {
+		if (jitterz_bench_record(&config)) {
+			fprintf(stderr, "Out of memory\n");
+			exit(1);
+		}
+		return 0;
+	}
+
+	jz = jitterz_create();
+	probes = calloc(num_cpus, sizeof(*probes));
+	if (!jz || !probes) {
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+	for (n = 0; n < num_cpus; n++) {
+		struct window_history *h = &probes[n].history;
+
+		probes[n].cpu = cpu_list[n];
+		if (!daemon_mode)
+			continue;
+		h->recent_size = WINDOW_RECENT_SECONDS / config.interval + 2;
+		h->recent = calloc(h->recent_size, sizeof(*h->recent));
+		if (!h->recent) {
+			fprintf(stderr, "Out of memory\n");
+			exit(1);
+		}
+	}
+
+	if (audit)
+		run_audit();
+	if (audit > 1) {
+		if (output_format != OUTPUT_TEXT)
+			emit_report(0.0);
+		return audit_warnings ? 2 : 0;
+	}
+
+	if (stall_file_name) {
+		stall_file = fopen(stall_file_name, "w");
+		if (!stall_file) {
+			fprintf(stderr, "Could not open %s: %s\n",
+				stall_file_name, strerror(errno));
+			exit(1);
+		}
+	}
+	if (jitterz_configure(jz, &config)) {
+		fprintf(stderr, "%s\n", jitterz_error(jz));
+		fail_exit(false);
+	}
+	if (daemon_mode || config.shm_name || stall_file || metrics_file) {
+		signal(SIGTERM, stop_handler);
+		signal(SIGINT, stop_handler);
+	}
+	/* --mode=memory turns on the histogram */
+	config.hdr_digits = jz->config.hdr_digits;
+	if (output_format == OUTPUT_TEXT) {
+		print_clock_costs();
+		fprintf(stdout, "frequency : %" PRIu64 " ticks/sec (%s)\n",
+			jz->frequency, jz->frequency_source);
+		if (config.mode == JITTERZ_MODE_MEMORY)
+			fprintf(stdout, "working set : %" PRIu64 " bytes (%s, %s)\n",
+				jz->wss, wss_arg,
+				config.access == JITTERZ_ACCESS_CHASE ? "chase" :
+									"stream");
+	}
+
+	if (irq_stats) {
+		read_irq_snapshots(&irqs_start, &softirqs_start);
+		read_irq_snapshots(&irqs_last, &softirqs_last);
+	}
+	if (smi_stats)
+		read_smi_counts(false);
+	for (n = 0; n < num_cpus && perf_stats; n++)
+		open_perf_events(&probes[n]);
+	if (perf_stats) {
+		read_perf_counts(false);
+		for (n = 0; n < num_cpus; n++)
+			memcpy(probes[n].perf_last, probes[n].perf_start,
+			       sizeof(probes[n].perf_last));
+	}
+	if (stall_file)
+		start_stall_file();
+	if (config.interval || stall_file) {
+		if (housekeeping_cpu < 0)
+			housekeeping_cpu = pick_housekeeping_cpu();
+		if (smi_stats &&
+		    (housekeeping_cpu < 0 ||
+		     read_smi_count(housekeeping_cpu, &smi_last)))
+			fprintf(stderr,
+				"Warning: no housekeeping cpu MSR_SMI_COUNT, SMIs are only counted for the whole test\n");
+		if (pthread_create(&reporter_thread, NULL, reporter, NULL)) {
+			fprintf(stderr, "Error while creating reporter thread\n");
+			fail_exit(false);
+		}
+	}
+	/* jitterz_run() clears a stop that came before it */
+	if (!stop_requested && jitterz_run(jz, run_time)) {
+		fprintf(stderr, "%s\n", jitterz_error(jz));
+		fail_exit(config.interval || stall_file);
+	}
+	for (n = 0; n < num_cpus; n++) {
+		struct cpu_state *s = &jz->cpu_states[n];
+		struct jitterz_snapshot snap;
+		double floor_ns;
+
+		if (s->real_duration > real_duration)
+			real_duration = s->real_duration;
+		jitterz_snapshot(jz, n, &snap);
+		floor_ns = snap.min_delta_ns > snap.typical_delta_ns ?
+				   snap.min_delta_ns : snap.typical_delta_ns;
+		if (config.mode != JITTERZ_MODE_TIMER && floor_ns &&
+		    config.threshold_ns < FLOOR_FACTOR * floor_ns)
+			fprintf(stderr,
+				"Warning: cpu %d loop takes %.1f nsec, the %" PRIu64 " nsec stall threshold counts the loop itself\n",
+				s->cpu, floor_ns, config.threshold_ns);
+		if (fabs(s->frequency_run - jz->frequency) / jz->frequency >
+		    FREQUENCY_TOLERNCE)
+			fprintf(stderr,
+				"Warning: cpu %d ran at %.0f ticks/sec, calibrated %" PRIu64 "\n",
+				s->cpu, s->frequency_run, jz->frequency);
+	}
+	if (irq_stats)
+		read_irq_snapshots(&irqs_end, &softirqs_end);
+	if (smi_stats)
+		read_smi_counts(true);
+	if (perf_stats)
+		read_perf_counts(true);
+	if (config.interval || stall_file) {
+		__atomic_store_n(&measurement_done, 1, __ATOMIC_RELEASE);
+		pthread_join(reporter_thread, NULL);
+	}
+
+	switch (output_format) {
+	case OUTPUT_TEXT:
+		print_text_report(real_duration);
+		break;
+	case OUTPUT_JSON:
+	case OUTPUT_CSV:
+		emit_report(real_duration);
+		break;
+	}
 
+	jitterz_destroy(jz);
 	return 0;
 }
@@ -0,0 +1,257 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ * libjitterz
+ *
+ * The jitterz measurement as a library, so a program can check the
+ * cpus it is about to use, e.g. a latency critical daemon certifying
+ * its isolated cpus at startup.
+ *
+ *	struct jitterz_config config;
+ *	struct jitterz_snapshot snap;
+ *	struct jitterz *j = jitterz_create();
+ *	int cpus[] = { 2, 3 };
+ *
+ *	jitterz_default_config(&config);
+ *	config.cpus = cpus;
+ *	config.nr_cpus = 2;
+ *	if (!j || jitterz_configure(j, &config) || jitterz_run(j, 10))
+ *		fprintf(stderr, "%s\n", j ? jitterz_error(j) : "no memory");
+ *	else if (!jitterz_snapshot(j, 0, &snap))
+ *		printf("cpu %d lost %f sec\n", snap.cpu, snap.lost_s);
+ *	jitterz_destroy(j);
+ *
+ * Functions returning int return 0 on success and -1 on failure, with
+ * jitterz_error() saying why.  The caller should mlockall() first, as
+ * jitterz does, so the measurement does not take page faults.
+ *
+ * Copyright 2019-2020 Tom Rix <trix@redhat.com>
+ *
+ */
+#ifndef JITTERZ_H
+#define JITTERZ_H
+
+#include <stdint.h>
+#include <time.h>
+
+#ifndef SCHED_DEADLINE
+#define SCHED_DEADLINE 6 /* not in every libc's sched.h */
+#endif
+
+#define JITTERZ_BUCKETS 16
+#define JITTERZ_FINE_BUCKETS 64
+
+/* Where ticks come from */
+enum jitterz_time_source {
+	JITTERZ_TS_GETTIME, /* clock_gettime(), ticks are nsec */
+	JITTERZ_TS_RDTSC, /* x86 lfence; rdtsc */
+	JITTERZ_TS_RDTSCP, /* x86 rdtscp */
+	JITTERZ_TS_CNTVCT, /* arm64 virtual counter */
+};
+
+/* What the measurement threads do */
+enum jitterz_mode {
+	JITTERZ_MODE_BUSY, /* spin in the tight loop looking for gaps */
+	JITTERZ_MODE_TIMER, /* sleep for a period and measure wakeup latency */
+	JITTERZ_MODE_MEMORY, /* touch a working set between reads of the time */
+};
+
+/* JITTERZ_MODE_MEMORY */
+enum jitterz_access {
+	JITTERZ_ACCESS_CHASE, /* dependent loads in a random cycle of lines */
+	JITTERZ_ACCESS_STREAM, /* sequential loads, one per cache line */
+};
+
+/* Everything the jitterz command line options set for the measurement */
+struct jitterz_config {
+	const int *cpus; /* measured cpus, copied by jitterz_configure() */
+	int nr_cpus;
+	int policy; /* SCHED_*, of the measurement threads */
+	int priority;
+	/* SCHED_DEADLINE runtime <= deadline <= period */
+	uint64_t dl_runtime_ns;
+	uint64_t dl_deadline_ns;
+	uint64_t dl_period_ns;
+	clockid_t clock; /* for JITTERZ_TS_GETTIME */
+	enum jitterz_time_source time_source;
+	uint64_t threshold_ns; /* shortest gap counted as a stall */
+	enum jitterz_mode mode;
+	uint64_t period_ns; /* JITTERZ_MODE_TIMER wakeup period */
+	const char *wss; /* JITTERZ_MODE_MEMORY bytes or l1, l2, l3, llc, dram */
+	enum jitterz_access access;
+	int accesses; /* JITTERZ_MODE_MEMORY loads per iteration */
+	uint64_t stall_log; /* stalls kept per cpu, 0 is off */
+	int hdr_digits; /* percentile histogram digits 1-3, 0 is off */
+	int interval; /* seconds between interval samples, 0 is off */
+	uint64_t tracemark_ns; /* trace_marker for longer stalls, 0 is off */
+	uint64_t breaktrace_ns; /* stop tracing and the run, 0 is off */
+	uint64_t fine_ns; /* JITTERZ_MODE_BUSY histogram every delta below */
+	int top_stalls; /* longest stalls kept per cpu, 0 is off */
+	/*
+	 * Stalls while at least correlate cpus are stalled at once are
+	 * global, the others local, 0 is off.  Turns on a stall_log.
+	 */
+	int correlate;
+	/* POSIX shared memory to publish the counts in, NULL is off */
+	const char *shm_name;
+};
+
+/* One measured cpu, see jitterz_snapshot() */
+struct jitterz_snapshot {
+	int cpu;
+	uint64_t iterations; /* of the measurement loop */
+	double duration_s; /* of the last finished run */
+	/* the loop's own resolution, stalls near it are the loop itself */
+	double samples_per_s; /* iterations per second */
+	double min_delta_ns; /* smallest change of the time seen */
+	double typical_delta_ns; /* time of one iteration on average */
+	double lost_s; /* time lost to stalls */
+	uint64_t stalls;
+	uint64_t max_ns; /* longest stall, 0 without hdr_digits */
+	/* counts[i] is the stalls from cutoff_ns[i] to cutoff_ns[i + 1] */
+	uint64_t cutoff_ns[JITTERZ_BUCKETS];
+	uint64_t counts[JITTERZ_BUCKETS];
+	/*
+	 * fine_counts[i] is the deltas from i to i + 1 times fine_width_ns,
+	 * the last one everything longer, 0 without fine_ns
+	 */
+	double fine_width_ns;
+	uint64_t fine_counts[JITTERZ_FINE_BUCKETS];
+	/* with correlate, stalls the stall_log lost are in neither class */
+	uint64_t local_stalls;
+	double local_lost_s;
+	uint64_t global_stalls;
+	double global_lost_s;
+	uint64_t global_events; /* machine wide events this cpu was in */
+};
+
+/* One of the longest stalls, see jitterz_longest_stalls() */
+struct jitterz_stall {
+	int cpu;
+	uint64_t realtime_ns; /* CLOCK_REALTIME at the start of the stall */
+	uint64_t ns; /* length of the stall */
+};
+
+/*
+ * The shared memory export, see shm_name.  Every cpu is updated by its
+ * measurement thread once a second with plain stores under a sequence
+ * count: odd while it writes, so a reader copies the cpu and retries
+ * if the count was odd or changed.  Readers never block the writer.
+ */
+#define JITTERZ_SHM_MAGIC 0x7a72656a /* "jerz" */
+#define JITTERZ_SHM_VERSION 1
+
+struct jitterz_shm_cpu {
+	uint64_t seq;
+	int32_t cpu;
+	int32_t second; /* seconds measured */
+	uint64_t iterations;
+	uint64_t lost_ticks;
+	uint64_t counts[JITTERZ_BUCKETS];
+} __attribute__((aligned(64)));
+
+struct jitterz_shm {
+	uint32_t magic;
+	uint32_t version;
+	int32_t nr_cpus;
+	uint32_t size; /* of the whole segment */
+	uint64_t frequency; /* ticks / sec */
+	uint64_t cutoff_ns[JITTERZ_BUCKETS];
+	struct jitterz_shm_cpu cpus[];
+};
+
+/*
+ * The binary stall log of jitterz --stall-file, read by jitterz-decode:
+ * the header, then fixed size records up to the end of the file, in
+ * native byte order.  Ticks convert to CLOCK_REALTIME through the
+ * anchor, which is 0 until the test started.
+ */
+#define JITTERZ_STALL_FILE_MAGIC "JZSTALLS"
+#define JITTERZ_STALL_FILE_VERSION 1
+
+struct jitterz_stall_file_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t records_offset; /* bytes from the start of the file */
+	uint64_t frequency; /* ticks / sec */
+	uint64_t threshold_ns; /* shortest stall recorded */
+	uint64_t anchor_tick;
+	uint64_t anchor_realtime_ns; /* CLOCK_REALTIME at anchor_tick */
+	char clock[16]; /* time source, e.g. monotonic or rdtsc */
+	int32_t nr_cpus;
+	int32_t cpus[]; /* nr_cpus measured cpus */
+};
+
+struct jitterz_stall_file_record {
+	uint64_t start_tick; /* tick before the gap */
+	uint64_t ticks; /* length of the gap */
+	int32_t cpu;
+} __attribute__((packed));
+
+struct jitterz;
+
+#pragma GCC visibility push(default)
+
+/* The defaults of the jitterz command, without any cpus */
+void jitterz_default_config(struct jitterz_config *config);
+
+/* NULL if out of memory */
+struct jitterz *jitterz_create(void);
+
+/*
+ * Check the config, pick the measurement loop and calibrate the time
+ * source, which may take a quarter of a second.  May be called again
+ * between runs.  On failure the context is left unconfigured, as if
+ * it was just created.
+ */
+int jitterz_configure(struct jitterz *j, const struct jitterz_config *config);
+
+/*
+ * Measure every cpu for seconds, or until jitterz_stop() if seconds is
+ * 0.  Blocks until the run ends; every run starts the counts over.
+ */
+int jitterz_run(struct jitterz *j, int seconds);
+
+/* End the run at the next second, safe from other threads and signals */
+void jitterz_stop(struct jitterz *j);
+
+/*
+ * Counts of the n-th measured cpu.  Exact once jitterz_run() returned,
+ * a moment behind while it runs.
+ */
+int jitterz_snapshot(struct jitterz *j, int n, struct jitterz_snapshot *snap);
+
+/* Stall length in nsec of a percentile, 0 without hdr_digits */
+double jitterz_percentile(struct jitterz *j, int n, double percentile);
+
+/*
+ * The longest stalls of all cpus, longest first, at most max of them
+ * and top_stalls of every cpu.  Returns how many, or -1.  Exact once
+ * jitterz_run() returned.
+ */
+int jitterz_longest_stalls(struct jitterz *j, struct jitterz_stall *stalls,
+			   int max);
+
+/*
+ * For external readers: map the segment of a running jitterz read only,
+ * NULL with errno set if it is missing or not a jitterz segment.
+ */
+const struct jitterz_shm *jitterz_shm_open(const char *name);
+
+/*
+ * Consistent copy of the n-th cpu.  -1 with errno EINVAL if there is no
+ * such cpu, or EAGAIN if the cpu was being written to every time it was
+ * tried, e.g. its writer was preempted or died mid update.
+ */
+int jitterz_shm_read(const struct jitterz_shm *shm, int n,
+		     struct jitterz_shm_cpu *cpu);
+
+void jitterz_shm_close(const struct jitterz_shm *shm);
+
+/* Why the last call failed */
+const char *jitterz_error(const struct jitterz *j);
+
+void jitterz_destroy(struct jitterz *j);
+
+#pragma GCC visibility pop
+
+#endif /* JITTERZ_H */
@@ -0,0 +1,196 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ * libjitterz internals shared with the jitterz command, which reports
+ * more than the public API gives.  Not installed, not a stable API.
+ *
+ * Copyright 2019-2020 Tom Rix <trix@redhat.com>
+ *
+ */
+#ifndef JITTERZ_INTERNAL_H
+#define JITTERZ_INTERNAL_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include "jitterz.h"
+
+#define NSEC_PER_SEC		1000000000
+#define NUMBER_BUCKETS JITTERZ_BUCKETS
+#define FINE_BUCKETS JITTERZ_FINE_BUCKETS
+#define HDR_DIGITS_DEFAULT 2
+#define TIMER_PERIOD_DEFAULT 1000000 /* nano sec */
+#define CACHE_LINE 64
+#define ACCESSES_DEFAULT 16
+#define STALL_LOG_CORRELATE 65536 /* --correlate without --stall-log */
+#define DL_RUNTIME_DEFAULT 500000 /* nano sec */
+#define DL_PERIOD_DEFAULT 1000000 /* nano sec */
+#define SHM_READ_TRIES 1000 /* jitterz_shm_read() gives up after */
+
+struct bucket {
+	uint64_t tick_boundry;
+	uint64_t count;
+	uint64_t time_boundry;
+};
+
+/*
+ * Log-linear (HDR style) histogram of stall lengths in ticks, see --hdr.
+ * Values are split into power of two buckets, each divided linearly into
+ * sub buckets fine enough for the requested significant digits, so the
+ * relative error is bounded everywhere and recording is a shift and an
+ * increment.
+ */
+#define HDR_HIGHEST_TICKS (1ULL << 42) /* larger stalls are clamped */
+struct hdr_hist {
+	int sub_bucket_half_count_magnitude;
+	uint64_t sub_bucket_half_count;
+	uint64_t sub_bucket_mask;
+	int counts_len;
+	uint64_t total;
+	uint64_t max;
+	uint64_t *counts;
+};
+
+/* One stall seen by the tight loop, see --stall-log */
+struct stall_record {
+	uint64_t start_tick; /* tick before the gap */
+	uint64_t ticks; /* length of the gap */
+	int cpu;
+};
+
+/*
+ * Cumulative counters of one cpu at the end of an interval, see
+ * --interval.  The reporter diffs consecutive samples.
+ */
+struct interval_sample {
+	int second; /* since the start of the test */
+	uint64_t lost_ticks;
+	uint64_t counts[NUMBER_BUCKETS];
+};
+
+/*
+ * Single producer (the measurement thread), single consumer (the
+ * reporter) ring of interval samples.  head and dropped are only
+ * written by the producer and tail only by the consumer, each side on
+ * its own cache line, and the samples start on a line of their own.
+ */
+#define INTERVAL_RING_SIZE 64 /* power of two */
+struct interval_ring {
+	uint64_t head __attribute__((aligned(64)));
+	uint64_t dropped; /* producer only, ring was full */
+	uint64_t tail __attribute__((aligned(64)));
+	struct interval_sample samples[INTERVAL_RING_SIZE]
+		__attribute__((aligned(64)));
+};
+
+struct jitterz;
+
+/*
+ * Everything one measurement thread touches while it runs.
+ * Each measured cpu gets its own, so the threads never share
+ * a cache line in the tight loop.
+ */
+struct cpu_state {
+	int cpu;
+	struct jitterz *j;
+	pthread_t thread;
+	struct bucket b[NUMBER_BUCKETS];
+	uint64_t accumulated_lost_ticks;
+	uint64_t delta_tick_min; /* first bucket's tick boundry */
+	int delta_tick_min_log2; /* floor(log2(delta_tick_min)) */
+	uint64_t trace_tick_min; /* --tracemark/--breaktrace, UINT64_MAX is off */
+	uint64_t frequency; /* ticks / sec */
+	double frequency_run; /* ticks / sec seen over the run */
+	uint64_t test_tick_start;
+	uint64_t realtime_start; /* CLOCK_REALTIME nsec at test_tick_start */
+	uint64_t iterations; /* of the tight loop */
+	uint64_t min_delta; /* smallest tick change seen, UINT64_MAX if none */
+	uint64_t timer_expected; /* --mode=timer next wakeup, 0 before the first */
+	double real_duration; /* sec */
+	/* ring of the most recent stalls, stall_mask + 1 entries */
+	struct stall_record *stalls;
+	uint64_t stall_mask;
+	uint64_t stall_count; /* total recorded, may exceed the ring */
+	/* min-heap on ticks of the top_size longest stalls, see --top */
+	struct stall_record *top;
+	int top_size;
+	int top_count;
+	/* --correlate, after the run */
+	uint64_t local_stalls;
+	uint64_t local_ticks;
+	uint64_t global_stalls;
+	uint64_t global_ticks;
+	uint64_t global_events;
+	struct hdr_hist hdr;
+	/* --fine, fine_shift is log2 of the bucket width in ticks */
+	int fine_shift;
+	uint64_t fine[FINE_BUCKETS];
+	struct interval_ring *intervals;
+	/* --mode=memory working set and where the walk is */
+	uint64_t *working_set;
+	uint64_t *working_set_end;
+	void **chase;
+	uint64_t *stream;
+	uint64_t sink; /* keeps the streamed loads alive */
+} __attribute__((aligned(64)));
+
+typedef void (*tight_loop_fn)(struct cpu_state *s, uint64_t tick,
+			      uint64_t end_tick);
+
+/* --clock values, in the order of their numbers */
+struct clock_desc {
+	const char *name;
+	clockid_t id;
+	tight_loop_fn loop;
+	tight_loop_fn fine_loop; /* with the --fine histogram */
+};
+#define NUMBER_CLOCKS 7
+extern const struct clock_desc jitterz_clocks[NUMBER_CLOCKS];
+
+/*
+ * The cost of one call of every clock, and its resolution, so a clock
+ * that falls back to a syscall (e.g. on some hypervisor guests) shows
+ * up before the test rather than as a high floor in the results.
+ */
+struct clock_cost {
+	bool supported;
+	double ns_per_call;
+	long resolution_ns;
+};
+
+/* A measurement context, see jitterz.h */
+struct jitterz {
+	struct jitterz_config config; /* cpus points at the copy below */
+	int *cpus;
+	struct cpu_state *cpu_states; /* config.nr_cpus of them */
+	tight_loop_fn loop; /* for config.mode and config.time_source */
+	uint64_t frequency; /* ticks / sec of the time source */
+	const char *frequency_source;
+	uint64_t wss; /* --mode=memory working set bytes */
+	struct clock_cost clock_costs[NUMBER_CLOCKS];
+	/* the measurement threads wait for each other, see wait_for_start() */
+	pthread_mutex_t start_lock;
+	pthread_cond_t start_cond;
+	int ready;
+	int starting;
+	int run_time; /* seconds, 0 runs until stopped */
+	int stop; /* set to end the run at the next second */
+	int failed; /* a measurement thread could not start */
+	/* --tracemark and --breaktrace */
+	int trace_marker_fd;
+	int tracing_on_fd;
+	int breaktrace_hit;
+	struct stall_record breaktrace_stall;
+	uint64_t global_events; /* --correlate, stalls of several cpus at once */
+	/* --shm, shm_name is our copy and shm NULL when off */
+	char *shm_name;
+	struct jitterz_shm *shm;
+	char error[256];
+};
+
+uint64_t jitterz_parse_size(const char *str);
+int jitterz_move_to_core(int cpu);
+const char *jitterz_policy_name(int policy);
+uint64_t jitterz_hdr_percentile(const struct hdr_hist *h, double percentile);
+int jitterz_bench_record(const struct jitterz_config *config);
+
+#endif /* JITTERZ_INTERNAL_H */
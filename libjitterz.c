@@ -0,0 +1,1906 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * libjitterz
+ *
+ * The measurement behind jitterz: the tight loops, the calibration of
+ * the time source and the histograms.  All state lives in the context
+ * so the measurement can be embedded, see jitterz.h.
+ *
+ * Copyright 2019-2020 Tom Rix <trix@redhat.com>
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <time.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <fcntl.h>
+#include <math.h>
+#include <limits.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#if defined(__i386__) || defined(__x86_64__)
+#include <cpuid.h>
+#endif
+#include "jitterz_internal.h"
+
+/* Record why a call failed for jitterz_error(), returns -1 */
+static int __attribute__((format(printf, 2, 3)))
+fail(struct jitterz *j, const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	vsnprintf(j->error, sizeof(j->error), fmt, ap);
+	va_end(ap);
+	return -1;
+}
+
+/* Parse a size such as 512K, 32M or 1G into bytes, 0 if invalid */
+uint64_t jitterz_parse_size(const char *str)
+{
+	char *end;
+	uint64_t size = strtoull(str, &end, 0);
+
+	switch (*end) {
+	case 'g':
+	case 'G':
+		size <<= 10;
+		/* fall through */
+	case 'm':
+	case 'M':
+		size <<= 10;
+		/* fall through */
+	case 'k':
+	case 'K':
+		size <<= 10;
+		end++;
+		break;
+	}
+	if (end == str || (*end && strcasecmp(end, "B")))
+		return 0;
+	return size;
+}
+
+static inline void initialize_buckets(struct cpu_state *s,
+				      uint64_t threshold_ns)
+{
+	struct bucket *b = s->b;
+	int i;
+
+	if (!s->delta_tick_min)
+		s->delta_tick_min = 1;
+	s->delta_tick_min_log2 = 63 - __builtin_clzll(s->delta_tick_min);
+	for (i = 0; i < NUMBER_BUCKETS; i++) {
+		b[i].count = 0;
+		if (i == 0) {
+			b[i].tick_boundry = s->delta_tick_min;
+			b[i].time_boundry = threshold_ns;
+		} else {
+			b[i].tick_boundry = b[i - 1].tick_boundry * 2;
+			b[i].time_boundry = b[i - 1].time_boundry * 2;
+		}
+	}
+}
+
+static int hdr_init(struct hdr_hist *h, int digits)
+{
+	uint64_t largest = 2, smallest_untrackable;
+	int magnitude = 0, buckets = 1;
+
+	while (digits--)
+		largest *= 10;
+	while ((1ULL << magnitude) < largest)
+		magnitude++;
+	h->sub_bucket_half_count_magnitude = magnitude - 1;
+	h->sub_bucket_half_count = 1ULL << (magnitude - 1);
+	h->sub_bucket_mask = (1ULL << magnitude) - 1;
+
+	smallest_untrackable = 1ULL << magnitude;
+	while (smallest_untrackable <= HDR_HIGHEST_TICKS) {
+		smallest_untrackable <<= 1;
+		buckets++;
+	}
+	h->counts_len = (buckets + 1) * h->sub_bucket_half_count;
+	h->counts = calloc(h->counts_len, sizeof(*h->counts));
+	if (!h->counts)
+		return -1;
+	h->total = 0;
+	h->max = 0;
+	return 0;
+}
+
+static void hdr_reset(struct hdr_hist *h)
+{
+	memset(h->counts, 0, h->counts_len * sizeof(*h->counts));
+	h->total = 0;
+	h->max = 0;
+}
+
+static inline int hdr_index(const struct hdr_hist *h, uint64_t ticks)
+{
+	int pow2ceiling = 64 - __builtin_clzll(ticks | h->sub_bucket_mask);
+	int bucket = pow2ceiling - (h->sub_bucket_half_count_magnitude + 1);
+	uint64_t sub = ticks >> bucket;
+
+	return ((bucket + 1) << h->sub_bucket_half_count_magnitude) +
+	       (sub - h->sub_bucket_half_count);
+}
+
+/* Lowest value that lands in counts[index] */
+static uint64_t hdr_lowest_at(const struct hdr_hist *h, int index)
+{
+	int bucket = (index >> h->sub_bucket_half_count_magnitude) - 1;
+	uint64_t sub = (index & (h->sub_bucket_half_count - 1)) +
+		       h->sub_bucket_half_count;
+
+	if (bucket < 0) {
+		sub -= h->sub_bucket_half_count;
+		bucket = 0;
+	}
+	return sub << bucket;
+}
+
+/* Highest value that lands in counts[index] */
+static uint64_t hdr_highest_at(const struct hdr_hist *h, int index)
+{
+	int bucket = (index >> h->sub_bucket_half_count_magnitude) - 1;
+
+	if (bucket < 0)
+		bucket = 0;
+	return hdr_lowest_at(h, index) + (1ULL << bucket) - 1;
+}
+
+static inline void hdr_record(struct hdr_hist *h, uint64_t ticks)
+{
+	ticks = ticks < HDR_HIGHEST_TICKS ? ticks : HDR_HIGHEST_TICKS;
+	h->counts[hdr_index(h, ticks)]++;
+	h->total++;
+	h->max = ticks > h->max ? ticks : h->max;
+}
+
+/* Stall length in ticks at or below which percentile % of stalls fall */
+uint64_t jitterz_hdr_percentile(const struct hdr_hist *h, double percentile)
+{
+	uint64_t target, seen = 0, v;
+	int i;
+
+	if (!h->total)
+		return 0;
+	target = ceil(percentile / 100. * h->total);
+	if (target < 1)
+		target = 1;
+	for (i = 0; i < h->counts_len; i++) {
+		seen += h->counts[i];
+		if (seen >= target)
+			break;
+	}
+	v = hdr_highest_at(h, i);
+	return v < h->max ? v : h->max;
+}
+
+/*
+ * Called from the tight loop, so no allocation or syscalls here.
+ * The ring was allocated and faulted in before the test started.
+ * stall_count is released so a reader on another cpu, the --stall-file
+ * writer, sees the record it counts.
+ */
+static inline void record_stall(struct cpu_state *s, uint64_t start,
+				uint64_t ticks)
+{
+	struct stall_record *r = &s->stalls[s->stall_count & s->stall_mask];
+
+	r->start_tick = start;
+	r->ticks = ticks;
+	r->cpu = s->cpu;
+	__atomic_store_n(&s->stall_count, s->stall_count + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Keep the longest stalls of a cpu in a min-heap on their length.  A
+ * stall no longer than the shortest kept costs one compare, a longer
+ * one replaces the root and sifts down in log2(top_size) steps.  Only
+ * stalls get here, the loop itself never does.
+ */
+static inline void record_top(struct cpu_state *s, uint64_t start,
+			      uint64_t ticks)
+{
+	struct stall_record *h = s->top;
+	int i, c;
+
+	if (s->top_count < s->top_size) {
+		/* not full yet, sift up from the end */
+		for (i = s->top_count++; i && h[(i - 1) / 2].ticks > ticks;
+		     i = (i - 1) / 2)
+			h[i] = h[(i - 1) / 2];
+	} else {
+		if (ticks <= h[0].ticks)
+			return;
+		for (i = 0; (c = 2 * i + 1) < s->top_size; i = c) {
+			if (c + 1 < s->top_size && h[c + 1].ticks < h[c].ticks)
+				c++;
+			if (h[c].ticks >= ticks)
+				break;
+			h[i] = h[c];
+		}
+	}
+	h[i].start_tick = start;
+	h[i].ticks = ticks;
+	h[i].cpu = s->cpu;
+}
+
+/*
+ * Bucket i covers [delta_tick_min << i, delta_tick_min << (i + 1)).
+ * With k = floor(log2(delta_tick_min)) and t = floor(log2(ticks)) the
+ * bucket is either t - k or t - k - 1, so one count-leading-zeros and
+ * one compare find it whatever the size of the stall.
+ */
+static inline int bucket_index(const struct cpu_state *s, uint64_t ticks)
+{
+	int i = 63 - __builtin_clzll(ticks) - s->delta_tick_min_log2;
+
+	i = i < NUMBER_BUCKETS ? i : NUMBER_BUCKETS - 1;
+	return i - (ticks < s->b[i].tick_boundry);
+}
+
+/*
+ * A stall crossed the --tracemark or --breaktrace threshold: annotate the
+ * kernel trace through the trace_marker fd opened before the test and,
+ * for the first --breaktrace stall, freeze the trace buffer and end the
+ * test.  This is the one place the tight loop makes syscalls, right
+ * after the stall it is reporting.
+ */
+static void __attribute__((noinline, cold))
+trace_stall(struct cpu_state *s, uint64_t start, uint64_t ticks)
+{
+	struct jitterz *j = s->j;
+	uint64_t ns = ticks * NSEC_PER_SEC / s->frequency;
+	char msg[128];
+	int len;
+
+	if (j->config.breaktrace_ns && ns >= j->config.breaktrace_ns &&
+	    !__atomic_exchange_n(&j->breaktrace_hit, 1, __ATOMIC_RELAXED)) {
+		len = snprintf(msg, sizeof(msg),
+			       "jitterz: breaktrace cpu %d stall %" PRIu64 " ns\n",
+			       s->cpu, ns);
+		write(j->trace_marker_fd, msg, len);
+		write(j->tracing_on_fd, "0", 1);
+		j->breaktrace_stall.start_tick = start;
+		j->breaktrace_stall.ticks = ticks;
+		j->breaktrace_stall.cpu = s->cpu;
+		__atomic_store_n(&j->stop, 1, __ATOMIC_RELAXED);
+		return;
+	}
+	if (j->config.tracemark_ns && ns >= j->config.tracemark_ns) {
+		len = snprintf(msg, sizeof(msg),
+			       "jitterz: cpu %d stall %" PRIu64 " ns\n", s->cpu,
+			       ns);
+		write(j->trace_marker_fd, msg, len);
+	}
+}
+
+/* Account a gap of at least delta_tick_min everywhere but the histogram */
+static inline void count_stall(struct cpu_state *s, uint64_t start,
+			       uint64_t ticks)
+{
+	if (ticks >= s->trace_tick_min)
+		trace_stall(s, start, ticks);
+	if (s->stalls)
+		record_stall(s, start, ticks);
+	if (s->top)
+		record_top(s, start, ticks);
+	s->accumulated_lost_ticks += ticks;
+	s->b[bucket_index(s, ticks)].count++;
+}
+
+static inline void update_buckets(struct cpu_state *s, uint64_t start,
+				  uint64_t ticks)
+{
+	if (ticks >= s->delta_tick_min) {
+		count_stall(s, start, ticks);
+		if (s->hdr.counts)
+			hdr_record(&s->hdr, ticks);
+	}
+}
+
+/*
+ * --fine
+ * Every delta of the tight loop, stall or not, in a linear histogram.
+ * The typical iteration times are where cache misses, SMT siblings and
+ * frequency changes show first, long before anything crosses the
+ * threshold.  Buckets are a power of two ticks wide so the index is a
+ * shift, and longer deltas are clamped into the last bucket with a
+ * conditional move rather than a branch.
+ */
+static inline __attribute__((always_inline)) void
+fine_record(struct cpu_state *s, uint64_t ticks)
+{
+	uint64_t i = ticks >> s->fine_shift;
+
+	i = i < FINE_BUCKETS - 1 ? i : FINE_BUCKETS - 1;
+	s->fine[i]++;
+}
+
+/*
+ * Readers for each time source.  They are always inlined into the
+ * specialised tight loops below, so the loop for one source contains
+ * nothing but that source's read.
+ */
+static inline __attribute__((always_inline)) uint64_t
+read_gettime(const clockid_t clk)
+{
+	struct timespec ts;
+
+	/* the clock was checked to work before the test started */
+	clock_gettime(clk, &ts);
+	return (uint64_t)((ts.tv_sec * NSEC_PER_SEC) + ts.tv_nsec);
+}
+
+#if defined(__i386__) || defined(__x86_64__)
+static inline __attribute__((always_inline)) uint64_t read_rdtsc(void)
+{
+	uint32_t l, h;
+
+	__asm__ __volatile__("lfence");
+	__asm__ __volatile__("rdtsc" : "=a"(l), "=d"(h));
+	return ((uint64_t)h << 32) | l;
+}
+
+static inline __attribute__((always_inline)) uint64_t read_rdtscp(void)
+{
+	uint32_t l, h, aux;
+
+	__asm__ __volatile__("rdtscp" : "=a"(l), "=d"(h), "=c"(aux));
+	return ((uint64_t)h << 32) | l;
+}
+#endif
+
+#if defined(__aarch64__)
+static inline __attribute__((always_inline)) uint64_t read_cntvct(void)
+{
+	uint64_t ret;
+
+	__asm__ __volatile__("isb; mrs %0, cntvct_el0" : "=r"(ret));
+	return ret;
+}
+#endif
+
+static inline __attribute__((always_inline)) uint64_t
+read_ticks(const enum jitterz_time_source src, const clockid_t clk)
+{
+	switch (src) {
+#if defined(__i386__) || defined(__x86_64__)
+	case JITTERZ_TS_RDTSC:
+		return read_rdtsc();
+	case JITTERZ_TS_RDTSCP:
+		return read_rdtscp();
+#endif
+#if defined(__aarch64__)
+	case JITTERZ_TS_CNTVCT:
+		return read_cntvct();
+#endif
+	default:
+		return read_gettime(clk);
+	}
+}
+
+/*
+ * The tight loop, specialised below for each time source so that the
+ * source is chosen once, before the test, rather than on every read.
+ *
+ * Loop until tick >= end_tick
+ *
+ * If the difference in old and current tick
+ * exceed the minimum tick treshold
+ *   increment the greatest bucket
+ *   accumulate total lost ticks
+ *
+ * keep the smallest difference, the floor of what the loop can see,
+ * with a compare and conditional move rather than a branch
+ *
+ * with fine, a constant of every specialisation, also record the
+ * difference in the --fine histogram
+ *
+ * set old_tick to current tick
+ */
+static inline __attribute__((always_inline)) void
+tight_loop(struct cpu_state *s, uint64_t tick, uint64_t end_tick,
+	   const enum jitterz_time_source src, const clockid_t clk,
+	   const bool fine)
+{
+	uint64_t old_tick = tick;
+	uint64_t iterations = 0;
+	uint64_t min_delta = s->min_delta;
+
+	while (tick < end_tick) {
+		uint64_t delta;
+
+		tick = read_ticks(src, clk);
+		iterations++;
+		if (tick == old_tick)
+			continue;
+		delta = tick - old_tick;
+		min_delta = delta < min_delta ? delta : min_delta;
+		if (fine)
+			fine_record(s, delta);
+		update_buckets(s, old_tick, delta);
+		old_tick = tick;
+	}
+	s->iterations += iterations;
+	s->min_delta = min_delta;
+}
+
+#define DEFINE_TIGHT_LOOPS(name, src, clk)                                    \
+	static void tight_loop_##name(struct cpu_state *s, uint64_t tick,     \
+				      uint64_t end_tick)                      \
+	{                                                                     \
+		tight_loop(s, tick, end_tick, src, clk, false);               \
+	}                                                                     \
+	static void tight_loop_fine_##name(struct cpu_state *s,               \
+					   uint64_t tick, uint64_t end_tick)  \
+	{                                                                     \
+		tight_loop(s, tick, end_tick, src, clk, true);                \
+	}
+#define DEFINE_GETTIME_LOOP(name, clk)                                        \
+	DEFINE_TIGHT_LOOPS(name, JITTERZ_TS_GETTIME, clk)
+
+DEFINE_GETTIME_LOOP(monotonic, CLOCK_MONOTONIC)
+DEFINE_GETTIME_LOOP(realtime, CLOCK_REALTIME)
+DEFINE_GETTIME_LOOP(monotonic_raw, CLOCK_MONOTONIC_RAW)
+DEFINE_GETTIME_LOOP(boottime, CLOCK_BOOTTIME)
+DEFINE_GETTIME_LOOP(tai, CLOCK_TAI)
+DEFINE_GETTIME_LOOP(monotonic_coarse, CLOCK_MONOTONIC_COARSE)
+DEFINE_GETTIME_LOOP(realtime_coarse, CLOCK_REALTIME_COARSE)
+
+const struct clock_desc jitterz_clocks[NUMBER_CLOCKS] = {
+	{ "monotonic", CLOCK_MONOTONIC, tight_loop_monotonic,
+	  tight_loop_fine_monotonic },
+	{ "realtime", CLOCK_REALTIME, tight_loop_realtime,
+	  tight_loop_fine_realtime },
+	{ "monotonic_raw", CLOCK_MONOTONIC_RAW, tight_loop_monotonic_raw,
+	  tight_loop_fine_monotonic_raw },
+	{ "boottime", CLOCK_BOOTTIME, tight_loop_boottime,
+	  tight_loop_fine_boottime },
+	{ "tai", CLOCK_TAI, tight_loop_tai, tight_loop_fine_tai },
+	{ "monotonic_coarse", CLOCK_MONOTONIC_COARSE,
+	  tight_loop_monotonic_coarse, tight_loop_fine_monotonic_coarse },
+	{ "realtime_coarse", CLOCK_REALTIME_COARSE,
+	  tight_loop_realtime_coarse, tight_loop_fine_realtime_coarse },
+};
+/* Returns clock ticks, for use outside of the tight loop */
+static inline uint64_t time_stamp_counter(const struct jitterz *j)
+{
+	return read_ticks(j->config.time_source, j->config.clock);
+}
+
+#if defined(__i386__) || defined(__x86_64__)
+DEFINE_TIGHT_LOOPS(rdtsc, JITTERZ_TS_RDTSC, 0)
+DEFINE_TIGHT_LOOPS(rdtscp, JITTERZ_TS_RDTSCP, 0)
+#endif
+
+#if defined(__aarch64__)
+DEFINE_TIGHT_LOOPS(cntvct, JITTERZ_TS_CNTVCT, 0)
+#endif
+
+#define TIGHT_LOOP(j, name)                                                   \
+	((j)->config.fine_ns ? tight_loop_fine_##name : tight_loop_##name)
+
+/*
+ * --mode=timer
+ * Instead of spinning, sleep until the next period with an absolute
+ * clock_nanosleep() and record how late each wakeup was.  Ticks are
+ * nanoseconds of the selected clock.  Every latency goes into the HDR
+ * histogram, latencies over the threshold also go through the same
+ * buckets as a stall of the tight loop.  Periods that were missed
+ * entirely are skipped rather than queued up.  The next wakeup carries
+ * over from one second to the next, and a second with no wakeup left
+ * is slept out, so periods of a second or more are kept as well.
+ */
+static void sleep_until(clockid_t clk, uint64_t ns)
+{
+	struct timespec next;
+
+	next.tv_sec = ns / NSEC_PER_SEC;
+	next.tv_nsec = ns % NSEC_PER_SEC;
+	while (clock_nanosleep(clk, TIMER_ABSTIME, &next, NULL) == EINTR)
+		;
+}
+
+static void timer_loop(struct cpu_state *s, uint64_t tick, uint64_t end_tick)
+{
+	clockid_t clk = s->j->config.clock;
+	uint64_t timer_period = s->j->config.period_ns;
+	uint64_t expected = s->timer_expected ? s->timer_expected :
+						tick + timer_period;
+	uint64_t iterations = 0;
+
+	while (expected < end_tick) {
+		uint64_t now;
+
+		sleep_until(clk, expected);
+		now = read_gettime(clk);
+		iterations++;
+		if (s->hdr.counts)
+			hdr_record(&s->hdr, now - expected);
+		if (now - expected >= s->delta_tick_min)
+			count_stall(s, expected, now - expected);
+		expected += timer_period;
+		if (now >= expected)
+			expected += (now - expected) / timer_period * timer_period +
+				    timer_period;
+	}
+	sleep_until(clk, end_tick);
+	s->timer_expected = expected;
+	s->iterations += iterations;
+}
+
+/*
+ * --mode=memory
+ * Between reads of the time do a fixed number of loads from a working
+ * set sized to a cache level (or DRAM), and histogram the time of every
+ * iteration.  An iteration slows down when a noisy neighbour evicts the
+ * working set from a shared cache or eats memory bandwidth, which the
+ * plain tight loop never sees.  Every iteration goes into the HDR
+ * histogram; iterations over the threshold also count as stalls.
+ */
+static inline __attribute__((always_inline)) void
+memory_loop(struct cpu_state *s, uint64_t tick, uint64_t end_tick,
+	    const enum jitterz_time_source src, const enum jitterz_access pattern)
+{
+	clockid_t clk = s->j->config.clock;
+	int accesses = s->j->config.accesses;
+	uint64_t old_tick = tick, iterations = 0, sum = 0;
+	uint64_t min_delta = s->min_delta;
+	uint64_t *line = s->stream;
+	void **p = s->chase;
+	int i;
+
+	while (tick < end_tick) {
+		if (pattern == JITTERZ_ACCESS_CHASE) {
+			for (i = 0; i < accesses; i++)
+				p = *p;
+		} else {
+			for (i = 0; i < accesses; i++) {
+				sum += *line;
+				line += CACHE_LINE / sizeof(*line);
+				if (line >= s->working_set_end)
+					line = s->working_set;
+			}
+		}
+		tick = read_ticks(src, clk);
+		iterations++;
+		hdr_record(&s->hdr, tick - old_tick);
+		/* a coarse clock may not move, 0 - 1 wraps and never wins */
+		min_delta = tick - old_tick - 1 < min_delta - 1 ?
+				    tick - old_tick : min_delta;
+		if (tick - old_tick >= s->delta_tick_min)
+			count_stall(s, old_tick, tick - old_tick);
+		old_tick = tick;
+	}
+	s->chase = p;
+	s->stream = line;
+	s->sink += sum;
+	s->iterations += iterations;
+	s->min_delta = min_delta;
+}
+
+#define DEFINE_MEMORY_LOOPS(name, src)                                        \
+	static void memory_chase_##name(struct cpu_state *s, uint64_t tick,   \
+					uint64_t end_tick)                    \
+	{                                                                     \
+		memory_loop(s, tick, end_tick, src, JITTERZ_ACCESS_CHASE);    \
+	}                                                                     \
+	static void memory_stream_##name(struct cpu_state *s, uint64_t tick,  \
+					 uint64_t end_tick)                   \
+	{                                                                     \
+		memory_loop(s, tick, end_tick, src, JITTERZ_ACCESS_STREAM);   \
+	}
+
+DEFINE_MEMORY_LOOPS(gettime, JITTERZ_TS_GETTIME)
+#if defined(__i386__) || defined(__x86_64__)
+DEFINE_MEMORY_LOOPS(rdtsc, JITTERZ_TS_RDTSC)
+DEFINE_MEMORY_LOOPS(rdtscp, JITTERZ_TS_RDTSCP)
+#endif
+#if defined(__aarch64__)
+DEFINE_MEMORY_LOOPS(cntvct, JITTERZ_TS_CNTVCT)
+#endif
+
+#define MEMORY_LOOP(j, name)                                                  \
+	((j)->config.access == JITTERZ_ACCESS_CHASE ? memory_chase_##name :   \
+						      memory_stream_##name)
+
+/*
+ * Allocate a cpu's working set from its own thread, after it is pinned,
+ * so the pages come from the local node.  mlockall(MCL_FUTURE) faults it
+ * all in here.  The chase is a single random cycle through every cache
+ * line (Sattolo's shuffle) so the hardware prefetchers can not follow it.
+ * It is kept for later runs.
+ */
+static int alloc_working_set(struct cpu_state *s)
+{
+	uint64_t lines = s->j->wss / CACHE_LINE, i, seed = 88172645463325252ULL;
+	uint64_t *order;
+
+	if (lines < 2)
+		lines = 2;
+	if (posix_memalign((void **)&s->working_set, CACHE_LINE,
+			   lines * CACHE_LINE)) {
+		s->working_set = NULL;
+		return -1;
+	}
+	s->working_set_end = s->working_set + lines * CACHE_LINE / sizeof(uint64_t);
+	s->stream = s->working_set;
+	memset(s->working_set, 0, lines * CACHE_LINE);
+	if (s->j->config.access != JITTERZ_ACCESS_CHASE)
+		return 0;
+
+	order = malloc(lines * sizeof(*order));
+	if (!order)
+		return -1;
+	for (i = 0; i < lines; i++)
+		order[i] = i;
+	for (i = lines - 1; i > 0; i--) {
+		uint64_t j, t;
+
+		/* xorshift64 */
+		seed ^= seed << 13;
+		seed ^= seed >> 7;
+		seed ^= seed << 17;
+		j = seed % i;
+		t = order[i];
+		order[i] = order[j];
+		order[j] = t;
+	}
+	for (i = 0; i < lines; i++)
+		*(void **)((char *)s->working_set + i * CACHE_LINE) =
+			(char *)s->working_set + order[i] * CACHE_LINE;
+	free(order);
+	s->chase = (void **)s->working_set;
+	return 0;
+}
+
+/*
+ * Size of a cache of the first measured cpu from sysfs, level 0 being
+ * the last level.  Instruction caches are skipped.
+ */
+static uint64_t cache_size(int cpu, int level)
+{
+	uint64_t ret = 0;
+	int i, best = 0;
+
+	for (i = 0;; i++) {
+		char path[256], type[32], size[32];
+		int l = 0;
+		FILE *f;
+
+		snprintf(path, sizeof(path),
+			 "/sys/devices/system/cpu/cpu%d/cache/index%d/level",
+			 cpu, i);
+		f = fopen(path, "r");
+		if (!f)
+			break;
+		if (fscanf(f, "%d", &l) != 1)
+			l = 0;
+		fclose(f);
+		snprintf(path, sizeof(path),
+			 "/sys/devices/system/cpu/cpu%d/cache/index%d/type",
+			 cpu, i);
+		f = fopen(path, "r");
+		if (!f || fscanf(f, "%31s", type) != 1 ||
+		    !strcmp(type, "Instruction")) {
+			if (f)
+				fclose(f);
+			continue;
+		}
+		fclose(f);
+		snprintf(path, sizeof(path),
+			 "/sys/devices/system/cpu/cpu%d/cache/index%d/size",
+			 cpu, i);
+		f = fopen(path, "r");
+		if (!f)
+			continue;
+		if (fscanf(f, "%31s", size) == 1 &&
+		    (level ? l == level : l > best)) {
+			ret = jitterz_parse_size(size);
+			best = l;
+		}
+		fclose(f);
+	}
+	return ret;
+}
+
+/*
+ * --wss is a size or the name of a cache level.  A cache level gets a
+ * working set of half the cache, so it fits with room for everything
+ * else; dram gets four times the last level cache.  0 if it is invalid.
+ */
+static uint64_t working_set_size(struct jitterz *j, const char *wss_arg,
+				 int cpu)
+{
+	static const struct {
+		const char *name;
+		int level;
+		int mul, div;
+	} levels[] = {
+		{ "l1", 1, 1, 2 },
+		{ "l2", 2, 1, 2 },
+		{ "l3", 3, 1, 2 },
+		{ "llc", 0, 1, 2 },
+		{ "dram", 0, 4, 1 },
+	};
+	uint64_t size;
+	int i;
+
+	for (i = 0; i < sizeof(levels) / sizeof(levels[0]); i++) {
+		if (strcasecmp(wss_arg, levels[i].name))
+			continue;
+		size = cache_size(cpu, levels[i].level);
+		if (!size)
+			fail(j, "Can not find the %s size of cpu %d", wss_arg,
+			     cpu);
+		return size * levels[i].mul / levels[i].div;
+	}
+	size = jitterz_parse_size(wss_arg);
+	if (!size)
+		fail(j, "Invalid working set size '%s'", wss_arg);
+	return size;
+}
+
+/* See struct clock_cost */
+#define CLOCK_COST_CALLS 10000
+static void measure_clock_costs(struct clock_cost *clock_costs)
+{
+	int i, j;
+
+	for (i = 0; i < NUMBER_CLOCKS; i++) {
+		struct timespec ts, te, res;
+		double ns;
+
+		clock_costs[i].supported = false;
+		if (clock_gettime(jitterz_clocks[i].id, &ts) == -1 ||
+		    clock_getres(jitterz_clocks[i].id, &res) == -1)
+			continue;
+		clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+		for (j = 0; j < CLOCK_COST_CALLS; j++)
+			clock_gettime(jitterz_clocks[i].id, &te);
+		clock_gettime(CLOCK_MONOTONIC_RAW, &te);
+		ns = (te.tv_sec - ts.tv_sec) * 1e9 + (te.tv_nsec - ts.tv_nsec);
+		clock_costs[i].supported = true;
+		clock_costs[i].ns_per_call = ns / CLOCK_COST_CALLS;
+		clock_costs[i].resolution_ns =
+			res.tv_sec * NSEC_PER_SEC + res.tv_nsec;
+	}
+}
+
+/* --clock entry of the configured clock, NULL if it has no tight loop */
+static const struct clock_desc *clock_desc(const struct jitterz *j)
+{
+	int i;
+
+	for (i = 0; i < NUMBER_CLOCKS; i++)
+		if (jitterz_clocks[i].id == j->config.clock)
+			return &jitterz_clocks[i];
+	return NULL;
+}
+
+/*
+ * Pick the tight loop for the configured time source, and make sure
+ * the source works here so the loop never has to check.
+ */
+static int select_tight_loop(struct jitterz *j)
+{
+	enum jitterz_mode mode = j->config.mode;
+
+	if (mode == JITTERZ_MODE_TIMER &&
+	    j->config.time_source != JITTERZ_TS_GETTIME)
+		return fail(j, "--mode=timer reads the time with clock_gettime()");
+	if (mode != JITTERZ_MODE_BUSY && j->config.fine_ns)
+		return fail(j, "--fine needs --mode=busy");
+
+	switch (j->config.time_source) {
+	case JITTERZ_TS_GETTIME: {
+		const struct clock_desc *clk = clock_desc(j);
+		struct timespec ts;
+
+		if (!clk)
+			return fail(j, "No tight loop for clock %d",
+				    (int)j->config.clock);
+		if (clock_gettime(clk->id, &ts) == -1)
+			return fail(j, "clock_gettime(%s) call failed: %s",
+				    clk->name, strerror(errno));
+		if (mode == JITTERZ_MODE_TIMER) {
+			/* an absolute time in the past returns at once */
+			ts.tv_sec = ts.tv_nsec = 0;
+			errno = clock_nanosleep(clk->id, TIMER_ABSTIME, &ts,
+						NULL);
+			if (errno)
+				return fail(j, "clock_nanosleep(%s) call failed: %s",
+					    clk->name, strerror(errno));
+			j->loop = timer_loop;
+			return 0;
+		}
+		if (mode == JITTERZ_MODE_MEMORY)
+			j->loop = MEMORY_LOOP(j, gettime);
+		else
+			j->loop = j->config.fine_ns ? clk->fine_loop : clk->loop;
+		return 0;
+	}
+#if defined(__i386__) || defined(__x86_64__)
+	case JITTERZ_TS_RDTSC:
+		if (mode == JITTERZ_MODE_MEMORY)
+			j->loop = MEMORY_LOOP(j, rdtsc);
+		else
+			j->loop = TIGHT_LOOP(j, rdtsc);
+		return 0;
+	case JITTERZ_TS_RDTSCP: {
+		unsigned int eax, ebx, ecx, edx;
+
+		/* CPUID.80000001H:EDX.RDTSCP[bit 27] */
+		if (!__get_cpuid(0x80000001, &eax, &ebx, &ecx, &edx) ||
+		    !(edx & (1 << 27)))
+			return fail(j, "RDTSCP is not supported by this cpu");
+		if (mode == JITTERZ_MODE_MEMORY)
+			j->loop = MEMORY_LOOP(j, rdtscp);
+		else
+			j->loop = TIGHT_LOOP(j, rdtscp);
+		return 0;
+	}
+#endif
+#if defined(__aarch64__)
+	case JITTERZ_TS_CNTVCT:
+		if (mode == JITTERZ_MODE_MEMORY)
+			j->loop = MEMORY_LOOP(j, cntvct);
+		else
+			j->loop = TIGHT_LOOP(j, cntvct);
+		return 0;
+#endif
+	default:
+		break;
+	}
+	return fail(j, "Add a time_stamp_counter function for your arch here %s:%d",
+		    __FILE__, __LINE__);
+}
+
+int jitterz_move_to_core(int cpu)
+{
+	cpu_set_t cpus;
+
+	CPU_ZERO(&cpus);
+	CPU_SET(cpu, &cpus);
+	return sched_setaffinity(0, sizeof(cpus), &cpus);
+}
+
+/*
+ * The sched_setattr() argument, which libc does not declare everywhere,
+ * as of the first version of the syscall
+ */
+struct dl_sched_attr {
+	uint32_t size;
+	uint32_t sched_policy;
+	uint64_t sched_flags;
+	int32_t sched_nice;
+	uint32_t sched_priority;
+	uint64_t sched_runtime; /* nsec, SCHED_DEADLINE only */
+	uint64_t sched_deadline;
+	uint64_t sched_period;
+};
+
+static inline int set_sched(const struct jitterz *j)
+{
+	struct sched_param p = { 0 };
+
+	if (j->config.policy == SCHED_DEADLINE) {
+		struct dl_sched_attr attr = { 0 };
+
+		attr.size = sizeof(attr);
+		attr.sched_policy = SCHED_DEADLINE;
+		attr.sched_runtime = j->config.dl_runtime_ns;
+		attr.sched_deadline = j->config.dl_deadline_ns;
+		attr.sched_period = j->config.dl_period_ns;
+		return syscall(SYS_sched_setattr, 0, &attr, 0);
+	}
+	p.sched_priority = j->config.priority;
+	return sched_setscheduler(0, j->config.policy, &p);
+}
+
+#if defined(__i386__) || defined(__x86_64__)
+/*
+ * TSC frequency from CPUID, 0 if the cpu does not say.
+ * Leaf 0x15 gives the TSC / crystal ratio and, on most parts, the
+ * crystal frequency.  Leaf 0x16 only gives the base frequency in MHz,
+ * which is what the TSC runs at when leaf 0x15 has no crystal.
+ */
+static uint64_t cpuid_tsc_frequency(void)
+{
+	unsigned int eax, ebx, ecx, edx;
+	unsigned int max_leaf = __get_cpuid_max(0, NULL);
+
+	if (max_leaf >= 0x15) {
+		__cpuid(0x15, eax, ebx, ecx, edx);
+		if (eax && ebx && ecx)
+			return (uint64_t)ecx * ebx / eax;
+	}
+	if (max_leaf >= 0x16) {
+		__cpuid(0x16, eax, ebx, ecx, edx);
+		if (eax)
+			return (uint64_t)eax * 1000000;
+	}
+	return 0;
+}
+#endif
+
+/*
+ * Read the time stamp counter and CLOCK_MONOTONIC_RAW as close together
+ * as possible.  The counter is read on both sides of the clock and the
+ * tightest of a few tries is kept.
+ */
+#define CALIBRATION_TRIES 5
+static void read_tick_and_clock(const struct jitterz *j, uint64_t *tick,
+				uint64_t *ns)
+{
+	uint64_t best = UINT64_MAX;
+	int i;
+
+	for (i = 0; i < CALIBRATION_TRIES; i++) {
+		struct timespec ts;
+		uint64_t before, after;
+
+		before = time_stamp_counter(j);
+		clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+		after = time_stamp_counter(j);
+		if (after - before < best) {
+			best = after - before;
+			*tick = before + (after - before) / 2;
+			*ns = ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+		}
+	}
+}
+
+/*
+ * Work out how many ticks the time source makes per second, once, before
+ * the test.  clock_gettime() ticks are nanoseconds, the arm64 counter
+ * publishes its frequency, on x86 ask CPUID and otherwise count ticks
+ * over a short sleep against CLOCK_MONOTONIC_RAW.
+ */
+#define CALIBRATION_NSEC 250000000
+static uint64_t calibrate_frequency(const struct jitterz *j, const char **how)
+{
+	struct timespec sleep = { 0, CALIBRATION_NSEC };
+	uint64_t tick_start, tick_end, ns_start, ns_end;
+
+	switch (j->config.time_source) {
+	case JITTERZ_TS_GETTIME:
+		*how = "clock_gettime";
+		return NSEC_PER_SEC;
+#if defined(__aarch64__)
+	case JITTERZ_TS_CNTVCT: {
+		uint64_t ret;
+
+		__asm__ __volatile__("mrs %0, cntfrq_el0" : "=r"(ret));
+		*how = "cntfrq_el0";
+		return ret;
+	}
+#endif
+#if defined(__i386__) || defined(__x86_64__)
+	case JITTERZ_TS_RDTSC:
+	case JITTERZ_TS_RDTSCP: {
+		uint64_t ret = cpuid_tsc_frequency();
+
+		if (ret) {
+			*how = "cpuid";
+			return ret;
+		}
+		break;
+	}
+#endif
+	default:
+		break;
+	}
+
+	read_tick_and_clock(j, &tick_start, &ns_start);
+	while (nanosleep(&sleep, &sleep) == -1 && errno == EINTR)
+		;
+	read_tick_and_clock(j, &tick_end, &ns_end);
+	*how = "calibrated against CLOCK_MONOTONIC_RAW";
+	return (tick_end - tick_start) * NSEC_PER_SEC / (ns_end - ns_start);
+}
+
+const char *jitterz_policy_name(int policy)
+{
+	const char *policystr = "";
+
+	switch (policy) {
+	case SCHED_OTHER:
+		policystr = "other";
+		break;
+	case SCHED_FIFO:
+		policystr = "fifo";
+		break;
+	case SCHED_RR:
+		policystr = "rr";
+		break;
+	case SCHED_BATCH:
+		policystr = "batch";
+		break;
+	case SCHED_IDLE:
+		policystr = "idle";
+		break;
+	case SCHED_DEADLINE:
+		policystr = "deadline";
+		break;
+	}
+	return policystr;
+}
+
+/*
+ * Called by the measurement thread between seconds, never from the tight
+ * loop.  Only plain stores and a release of head, no I/O; if the reporter
+ * has fallen a whole ring behind the sample is dropped rather than wait.
+ */
+static void publish_interval(struct cpu_state *s, int second)
+{
+	struct interval_ring *r = s->intervals;
+	uint64_t tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+	struct interval_sample *sample;
+	int i;
+
+	if (r->head - tail >= INTERVAL_RING_SIZE) {
+		r->dropped++;
+		return;
+	}
+	sample = &r->samples[r->head & (INTERVAL_RING_SIZE - 1)];
+	sample->second = second;
+	sample->lost_ticks = s->accumulated_lost_ticks;
+	for (i = 0; i < NUMBER_BUCKETS; i++)
+		sample->counts[i] = s->b[i].count;
+	__atomic_store_n(&r->head, r->head + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * --shm
+ * Called by the measurement thread between seconds, like
+ * publish_interval().  The seqlock write: an odd count, the data with
+ * plain stores, an even count, with release ordering in between.
+ */
+static void publish_shm(struct cpu_state *s, int second)
+{
+	struct jitterz_shm_cpu *c = &s->j->shm->cpus[s - s->j->cpu_states];
+	uint64_t seq = c->seq;
+	int i;
+
+	__atomic_store_n(&c->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	c->second = second;
+	c->iterations = s->iterations;
+	c->lost_ticks = s->accumulated_lost_ticks;
+	for (i = 0; i < NUMBER_BUCKETS; i++)
+		c->counts[i] = s->b[i].count;
+	__atomic_store_n(&c->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+static void close_shm(struct jitterz *j)
+{
+	if (j->shm) {
+		munmap(j->shm, j->shm->size);
+		shm_unlink(j->shm_name);
+	}
+	free(j->shm_name);
+	j->shm = NULL;
+	j->shm_name = NULL;
+}
+
+/*
+ * Create the segment before the test, so the measurement threads only
+ * ever store into memory that is mapped and faulted in
+ */
+static int open_shm(struct jitterz *j, const char *name)
+{
+	uint32_t size = sizeof(*j->shm) +
+			j->config.nr_cpus * sizeof(j->shm->cpus[0]);
+	int fd, n, i;
+
+	j->shm_name = strdup(name);
+	if (!j->shm_name)
+		return fail(j, "Out of memory");
+	/* never take over, nor later unlink, a segment of someone else */
+	fd = shm_open(j->shm_name, O_CREAT | O_EXCL | O_RDWR, 0644);
+	if (fd < 0 && errno == EEXIST)
+		return fail(j, "shm segment %s exists, another jitterz may be using it (remove /dev/shm/%s if it is stale)",
+			    j->shm_name, j->shm_name + (j->shm_name[0] == '/'));
+	if (fd < 0)
+		return fail(j, "shm_open(%s) failed: %s", j->shm_name,
+			    strerror(errno));
+	if (ftruncate(fd, size)) {
+		close(fd);
+		shm_unlink(j->shm_name);
+		return fail(j, "ftruncate(%s) failed: %s", j->shm_name,
+			    strerror(errno));
+	}
+	j->shm = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (j->shm == MAP_FAILED) {
+		j->shm = NULL;
+		shm_unlink(j->shm_name);
+		return fail(j, "mmap(%s) failed: %s", j->shm_name,
+			    strerror(errno));
+	}
+	memset(j->shm, 0, size);
+	j->shm->version = JITTERZ_SHM_VERSION;
+	j->shm->nr_cpus = j->config.nr_cpus;
+	j->shm->size = size;
+	j->shm->frequency = j->frequency;
+	for (i = 0; i < NUMBER_BUCKETS; i++)
+		j->shm->cutoff_ns[i] = j->cpu_states[0].b[i].time_boundry;
+	for (n = 0; n < j->config.nr_cpus; n++)
+		j->shm->cpus[n].cpu = j->cpus[n];
+	/* readers check the magic last */
+	__atomic_store_n(&j->shm->magic, JITTERZ_SHM_MAGIC, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/* Smallest stall in ticks that trace_stall() wants to see */
+static uint64_t trace_tick_min(const struct jitterz *j)
+{
+	uint64_t ns = UINT64_MAX;
+
+	if (j->config.tracemark_ns)
+		ns = j->config.tracemark_ns;
+	if (j->config.breaktrace_ns && j->config.breaktrace_ns < ns)
+		ns = j->config.breaktrace_ns;
+	if (ns == UINT64_MAX)
+		return UINT64_MAX;
+	return ns * j->frequency / NSEC_PER_SEC;
+}
+
+/*
+ * Open trace_marker, and tracing_on for --breaktrace, before the test so
+ * marking a stall is a single write().
+ */
+static void close_tracefs(struct jitterz *j)
+{
+	if (j->trace_marker_fd >= 0)
+		close(j->trace_marker_fd);
+	if (j->tracing_on_fd >= 0)
+		close(j->tracing_on_fd);
+	j->trace_marker_fd = j->tracing_on_fd = -1;
+}
+
+static int open_tracefs(struct jitterz *j)
+{
+	static const char *const roots[] = {
+		"/sys/kernel/tracing",
+		"/sys/kernel/debug/tracing",
+	};
+	uint64_t breaktrace_time = j->config.breaktrace_ns;
+	char path[256];
+	int i;
+
+	for (i = 0; i < 2 && j->trace_marker_fd < 0; i++) {
+		snprintf(path, sizeof(path), "%s/trace_marker", roots[i]);
+		j->trace_marker_fd = open(path, O_WRONLY);
+		if (j->trace_marker_fd < 0 || !breaktrace_time)
+			continue;
+		snprintf(path, sizeof(path), "%s/tracing_on", roots[i]);
+		j->tracing_on_fd = open(path, O_WRONLY);
+		if (j->tracing_on_fd < 0)
+			close_tracefs(j);
+	}
+	if (j->trace_marker_fd < 0)
+		return fail(j, "Error opening trace_marker%s, is tracefs mounted?",
+			    breaktrace_time ? " and tracing_on" : "");
+	return 0;
+}
+
+/*
+ * A measurement thread could not start: the first one to fail says why,
+ * and the run is stopped before its first second.
+ */
+static void thread_failed(struct jitterz *j, const char *what, int cpu)
+{
+	if (!__atomic_exchange_n(&j->failed, 1, __ATOMIC_RELAXED))
+		snprintf(j->error, sizeof(j->error), "%s on cpu %d", what, cpu);
+	__atomic_store_n(&j->stop, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Hold every measurement thread until all the threads of the run are
+ * ready, then release them together.  jitterz_run() lowers the count
+ * if it could not create them all.
+ */
+static void wait_for_start(struct jitterz *j)
+{
+	pthread_mutex_lock(&j->start_lock);
+	if (++j->ready >= j->starting)
+		pthread_cond_broadcast(&j->start_cond);
+	while (j->ready < j->starting)
+		pthread_cond_wait(&j->start_cond, &j->start_lock);
+	pthread_mutex_unlock(&j->start_lock);
+}
+
+/*
+ * Measurement thread, one per measured cpu.
+ * Pins and schedules itself, waits for all the other measurement
+ * threads to be ready so every cpu starts at the same time, then runs
+ * the tight loop.
+ */
+static void *measure(void *arg)
+{
+	struct cpu_state *s = arg;
+	struct jitterz *j = s->j;
+	uint64_t frequency = j->frequency;
+	struct timespec tvs, tve, tvr;
+	int i;
+	bool first = true;
+	uint64_t test_tick_start, test_tick_end;
+
+	/* return of this function must be tested for success */
+	if (jitterz_move_to_core(s->cpu) != 0)
+		thread_failed(j, "Error while setting thread affinity", s->cpu);
+	else if (set_sched(j) != 0)
+		/*
+		 * The kernel refuses a deadline task whose affinity is not
+		 * its whole root domain, see jitterz(8)
+		 */
+		thread_failed(j, j->config.policy == SCHED_DEADLINE &&
+					 (errno == EPERM || errno == EBUSY) ?
+				      "SCHED_DEADLINE needs an exclusive cpuset of just the measured cpu" :
+				      "Error while setting the scheduling policy",
+			      s->cpu);
+	else if (j->config.mode == JITTERZ_MODE_MEMORY && !s->working_set &&
+		 alloc_working_set(s))
+		thread_failed(j, "Out of memory for the working set", s->cpu);
+
+retry:
+	s->accumulated_lost_ticks = 0;
+	s->iterations = 0;
+	s->min_delta = UINT64_MAX;
+	s->stall_count = 0;
+	s->top_count = 0;
+	s->timer_expected = 0;
+	memset(s->fine, 0, sizeof(s->fine));
+	initialize_buckets(s, j->config.threshold_ns);
+	if (s->hdr.counts)
+		hdr_reset(&s->hdr);
+
+	/* only the first attempt is started in lock step */
+	if (first) {
+		wait_for_start(j);
+		first = false;
+	}
+
+	/*
+	 * Record the starting tick and clock time for the test, and the
+	 * wall clock time of the tick to date the stalls by
+	 */
+	test_tick_start = time_stamp_counter(j);
+	clock_gettime(CLOCK_REALTIME, &tvr);
+	clock_gettime(CLOCK_MONOTONIC_RAW, &tvs);
+	s->test_tick_start = test_tick_start;
+	s->realtime_start = tvr.tv_sec * (uint64_t)NSEC_PER_SEC + tvr.tv_nsec;
+
+	/* loop over seconds run time, forever if it is 0 */
+	for (i = 0; (!j->run_time || i < j->run_time) &&
+		    !__atomic_load_n(&j->stop, __ATOMIC_RELAXED);
+	     i++) {
+		uint64_t tick, end_tick, tick_overflow;
+
+		end_tick = tick = time_stamp_counter(j);
+		end_tick += frequency;
+		/*
+		 * Overflow check
+		 * If end_tick < tick, there will be an overlow
+		 * Add additional second's worth of ticks so
+		 * we do not have to check inside the while loop
+		 * to cover the case that end_tick is close to
+		 * overflowing.
+		 */
+		tick_overflow = end_tick + frequency;
+		if (tick_overflow < tick)
+			goto retry;
+
+		j->loop(s, tick, end_tick);
+		if (s->intervals && (i + 1) % j->config.interval == 0)
+			publish_interval(s, i + 1);
+		if (j->shm)
+			publish_shm(s, i + 1);
+	}
+	/* Record the test ending tick and clock time */
+	test_tick_end = time_stamp_counter(j);
+	/* overflow */
+	if (test_tick_end < test_tick_start)
+		goto retry;
+	clock_gettime(CLOCK_MONOTONIC_RAW, &tve);
+	/* sec */
+	s->real_duration = tve.tv_sec - tvs.tv_sec +
+			   (tve.tv_nsec - tvs.tv_nsec) / 1e9;
+
+	/*
+	 * The frequency was calibrated before the test, the whole run
+	 * is only a cross check of it.
+	 */
+	if (s->real_duration > 0)
+		s->frequency_run = (test_tick_end - test_tick_start) /
+				   s->real_duration;
+	return NULL;
+}
+
+/*
+ * Allocate the stall ring for a cpu.  The size is rounded up to a power
+ * of two so the tight loop can wrap with a mask.  mlockall(MCL_FUTURE)
+ * is already in effect, and the memset faults every page in now rather
+ * than on the first stall.
+ */
+static int alloc_stall_log(struct cpu_state *s, uint64_t stall_log_size)
+{
+	uint64_t n = 1;
+
+	while (n < stall_log_size)
+		n <<= 1;
+	s->stalls = malloc(n * sizeof(*s->stalls));
+	if (!s->stalls)
+		return -1;
+	memset(s->stalls, 0, n * sizeof(*s->stalls));
+	s->stall_mask = n - 1;
+	return 0;
+}
+
+static void free_cpu_states(struct jitterz *j)
+{
+	int n;
+
+	for (n = 0; j->cpu_states && n < j->config.nr_cpus; n++) {
+		struct cpu_state *s = &j->cpu_states[n];
+
+		free(s->stalls);
+		free(s->top);
+		free(s->hdr.counts);
+		free(s->intervals);
+		free(s->working_set);
+	}
+	free(j->cpu_states);
+	j->cpu_states = NULL;
+	free(j->cpus);
+	j->cpus = NULL;
+}
+
+/* A start or the end of a stall, for the sweep in classify_stalls() */
+struct stall_edge {
+	uint64_t tick;
+	uint64_t k; /* stall index, the low bit is set on the start */
+};
+
+static int earlier_edge(const void *a, const void *b)
+{
+	const struct stall_edge *x = a, *y = b;
+
+	if (x->tick != y->tick)
+		return x->tick < y->tick ? -1 : 1;
+	/* stalls that only touch do not overlap, ends go first */
+	return (int)(x->k & 1) - (int)(y->k & 1);
+}
+
+/*
+ * --correlate
+ * Merge the stall logs of all cpus on the common tick timebase (the
+ * clock, or the TSC which is synchronised across cpus) and sweep over
+ * the starts and ends of the stalls.  A global event is a stretch of
+ * time where at least correlate cpus are stalled at once, e.g. an SMI
+ * or an IPI storm, and every stall overlapping one is global.  The
+ * rest are local to their cpu.  Stalls the ring has dropped are left
+ * out.
+ */
+static int classify_stalls(struct jitterz *j)
+{
+	int nr_cpus = j->config.nr_cpus, active = 0, n;
+	struct stall_record *all;
+	struct stall_edge *edges;
+	uint64_t count = 0, i, k;
+	uint64_t *current; /* stall index + 1 a cpu is in, 0 is none */
+	uint64_t *last_event; /* the last global event a cpu was counted in */
+	bool *global;
+
+	for (n = 0; n < nr_cpus; n++) {
+		struct cpu_state *s = &j->cpu_states[n];
+
+		s->local_stalls = s->local_ticks = 0;
+		s->global_stalls = s->global_ticks = s->global_events = 0;
+		count += s->stall_count < s->stall_mask + 1 ?
+				 s->stall_count : s->stall_mask + 1;
+	}
+	j->global_events = 0;
+	all = malloc((count + 1) * sizeof(*all));
+	edges = malloc((2 * count + 1) * sizeof(*edges));
+	global = calloc(count + 1, sizeof(*global));
+	current = calloc(nr_cpus, sizeof(*current));
+	last_event = calloc(nr_cpus, sizeof(*last_event));
+	if (!all || !edges || !global || !current || !last_event) {
+		free(all);
+		free(edges);
+		free(global);
+		free(current);
+		free(last_event);
+		return fail(j, "Out of memory to correlate %" PRIu64 " stalls",
+			    count);
+	}
+	count = 0;
+	for (n = 0; n < nr_cpus; n++) {
+		struct cpu_state *s = &j->cpu_states[n];
+
+		for (i = s->stall_count > s->stall_mask + 1 ?
+				 s->stall_count - s->stall_mask - 1 : 0;
+		     i < s->stall_count; i++) {
+			all[count] = s->stalls[i & s->stall_mask];
+			/* the copy keeps the index of the cpu_state */
+			all[count].cpu = n;
+			edges[2 * count].tick = all[count].start_tick;
+			edges[2 * count].k = count << 1 | 1;
+			edges[2 * count + 1].tick =
+				all[count].start_tick + all[count].ticks;
+			edges[2 * count + 1].k = count << 1;
+			count++;
+		}
+	}
+	qsort(edges, 2 * count, sizeof(*edges), earlier_edge);
+
+	for (i = 0; i < 2 * count; i++) {
+		k = edges[i].k >> 1;
+		n = all[k].cpu;
+		if (!(edges[i].k & 1)) {
+			current[n] = 0;
+			active--;
+			continue;
+		}
+		current[n] = k + 1;
+		if (++active < j->config.correlate)
+			continue;
+		if (active == j->config.correlate)
+			j->global_events++;
+		/* everyone stalled now is in the event */
+		for (n = 0; n < nr_cpus; n++) {
+			if (!current[n])
+				continue;
+			global[current[n] - 1] = true;
+			if (last_event[n] != j->global_events) {
+				last_event[n] = j->global_events;
+				j->cpu_states[n].global_events++;
+			}
+		}
+	}
+
+	for (k = 0; k < count; k++) {
+		struct cpu_state *s = &j->cpu_states[all[k].cpu];
+
+		if (global[k]) {
+			s->global_stalls++;
+			s->global_ticks += all[k].ticks;
+		} else {
+			s->local_stalls++;
+			s->local_ticks += all[k].ticks;
+		}
+	}
+	free(all);
+	free(edges);
+	free(global);
+	free(current);
+	free(last_event);
+	return 0;
+}
+
+/*
+ * --bench-record
+ * Time update_buckets() for stalls landing in every bucket, and beyond
+ * the last one, to check the cost of recording does not depend on the
+ * size of the stall.  Ticks are nanoseconds here.
+ */
+#define BENCH_SAMPLES 4096
+#define BENCH_ROUNDS 2000
+int jitterz_bench_record(const struct jitterz_config *config)
+{
+	static uint64_t samples[BENCH_SAMPLES];
+	struct cpu_state *s;
+	int i, j, r;
+
+	if (posix_memalign((void **)&s, 64, sizeof(*s)))
+		return -1;
+	memset(s, 0, sizeof(*s));
+	s->cpu = config->nr_cpus ? config->cpus[0] : 0;
+	s->trace_tick_min = UINT64_MAX;
+	s->delta_tick_min = config->threshold_ns;
+	initialize_buckets(s, config->threshold_ns);
+	if (config->hdr_digits && hdr_init(&s->hdr, config->hdr_digits)) {
+		free(s);
+		return -1;
+	}
+	fprintf(stdout, "stall (usec) : nsec per record\n");
+	for (i = 0; i <= NUMBER_BUCKETS; i++) {
+		uint64_t ticks = s->delta_tick_min << i;
+		struct timespec ts, te;
+		double ns;
+
+		for (j = 0; j < BENCH_SAMPLES; j++)
+			samples[j] = ticks + (j & 7);
+		clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+		for (r = 0; r < BENCH_ROUNDS; r++)
+			for (j = 0; j < BENCH_SAMPLES; j++)
+				update_buckets(s, 0, samples[j]);
+		clock_gettime(CLOCK_MONOTONIC_RAW, &te);
+		ns = (te.tv_sec - ts.tv_sec) * 1e9 + (te.tv_nsec - ts.tv_nsec);
+		fprintf(stdout, "%.1f : %.2f\n", ticks / 1000.,
+			ns / ((double)BENCH_ROUNDS * BENCH_SAMPLES));
+	}
+	free(s->hdr.counts);
+	free(s);
+	return 0;
+}
+
+/*
+ * The public API, see jitterz.h
+ */
+void jitterz_default_config(struct jitterz_config *config)
+{
+	memset(config, 0, sizeof(*config));
+	config->policy = SCHED_FIFO;
+	config->priority = 5;
+	config->dl_runtime_ns = DL_RUNTIME_DEFAULT;
+	config->dl_deadline_ns = DL_PERIOD_DEFAULT;
+	config->dl_period_ns = DL_PERIOD_DEFAULT;
+	config->clock = CLOCK_MONOTONIC;
+	config->time_source = JITTERZ_TS_GETTIME;
+	config->threshold_ns = 500;
+	config->mode = JITTERZ_MODE_BUSY;
+	config->period_ns = TIMER_PERIOD_DEFAULT;
+	config->wss = "llc";
+	config->access = JITTERZ_ACCESS_CHASE;
+	config->accesses = ACCESSES_DEFAULT;
+}
+
+struct jitterz *jitterz_create(void)
+{
+	struct jitterz *j = calloc(1, sizeof(*j));
+
+	if (!j)
+		return NULL;
+	jitterz_default_config(&j->config);
+	j->trace_marker_fd = j->tracing_on_fd = -1;
+	pthread_mutex_init(&j->start_lock, NULL);
+	pthread_cond_init(&j->start_cond, NULL);
+	return j;
+}
+
+/*
+ * The narrowest power of two bucket width in ticks that still leaves
+ * the last --fine bucket for deltas of fine_ns and more only.
+ */
+static int fine_shift(const struct jitterz *j)
+{
+	uint64_t ticks = j->config.fine_ns * j->frequency / NSEC_PER_SEC;
+	int shift = 0;
+
+	while (ticks && (ticks - 1) >> shift >= FINE_BUCKETS - 1)
+		shift++;
+	return shift;
+}
+
+static int configure(struct jitterz *j, const struct jitterz_config *config)
+{
+	int n;
+
+	free_cpu_states(j);
+	close_tracefs(j);
+	close_shm(j);
+	j->config = *config;
+	/* only read here, the caller's strings need not outlive the call */
+	j->config.wss = NULL;
+	j->config.shm_name = NULL;
+	if (config->nr_cpus <= 0 || !config->cpus)
+		return fail(j, "No cpus to measure");
+	if (config->policy == SCHED_DEADLINE &&
+	    (config->dl_runtime_ns < 1024 ||
+	     config->dl_runtime_ns > config->dl_deadline_ns ||
+	     config->dl_deadline_ns > config->dl_period_ns))
+		return fail(j, "SCHED_DEADLINE needs 1 usec <= runtime <= deadline <= period");
+	if (config->correlate && (config->correlate < 2 ||
+				  config->correlate > config->nr_cpus))
+		return fail(j, "--correlate=%d needs 2 to %d cpus",
+			    config->correlate, config->nr_cpus);
+	/* the classification runs over the stall logs */
+	if (config->correlate && !config->stall_log)
+		j->config.stall_log = STALL_LOG_CORRELATE;
+	j->cpus = malloc(config->nr_cpus * sizeof(*j->cpus));
+	if (!j->cpus)
+		return fail(j, "Out of memory");
+	memcpy(j->cpus, config->cpus, config->nr_cpus * sizeof(*j->cpus));
+	j->config.cpus = j->cpus;
+
+	measure_clock_costs(j->clock_costs);
+	if (select_tight_loop(j))
+		return -1;
+	j->frequency = calibrate_frequency(j, &j->frequency_source);
+
+	if (config->mode == JITTERZ_MODE_MEMORY) {
+		j->wss = working_set_size(j, config->wss ? config->wss : "llc",
+					  j->cpus[0]);
+		if (!j->wss)
+			return -1;
+		/* every iteration is recorded, so always keep a histogram */
+		if (!j->config.hdr_digits)
+			j->config.hdr_digits = HDR_DIGITS_DEFAULT;
+	}
+
+	if (posix_memalign((void **)&j->cpu_states, 64,
+			   config->nr_cpus * sizeof(*j->cpu_states))) {
+		j->cpu_states = NULL;
+		return fail(j, "Out of memory");
+	}
+	memset(j->cpu_states, 0, config->nr_cpus * sizeof(*j->cpu_states));
+	for (n = 0; n < config->nr_cpus; n++) {
+		struct cpu_state *s = &j->cpu_states[n];
+
+		s->cpu = j->cpus[n];
+		s->j = j;
+		s->frequency = j->frequency;
+		s->delta_tick_min = (config->threshold_ns * j->frequency) /
+				    1000000000; /* ticks/nsec */
+		s->trace_tick_min = trace_tick_min(j);
+		s->fine_shift = fine_shift(j);
+		initialize_buckets(s, config->threshold_ns);
+		if (j->config.stall_log &&
+		    alloc_stall_log(s, j->config.stall_log))
+			return fail(j, "Out of memory for %" PRIu64 " stall records",
+				    j->config.stall_log);
+		if (config->top_stalls > 0) {
+			s->top = calloc(config->top_stalls, sizeof(*s->top));
+			if (!s->top)
+				return fail(j, "Out of memory for %d stalls",
+					    config->top_stalls);
+			s->top_size = config->top_stalls;
+		}
+		if (j->config.hdr_digits &&
+		    hdr_init(&s->hdr, j->config.hdr_digits))
+			return fail(j, "Out of memory for histogram");
+		if (config->interval) {
+			s->intervals = calloc(1, sizeof(*s->intervals));
+			if (!s->intervals)
+				return fail(j, "Out of memory");
+		}
+	}
+	if ((config->tracemark_ns || config->breaktrace_ns) && open_tracefs(j))
+		return -1;
+	if (config->shm_name && open_shm(j, config->shm_name))
+		return -1;
+	return 0;
+}
+
+int jitterz_configure(struct jitterz *j, const struct jitterz_config *config)
+{
+	if (!configure(j, config))
+		return 0;
+	/* leave nothing half set up for jitterz_run() to trip over */
+	free_cpu_states(j);
+	close_tracefs(j);
+	close_shm(j);
+	return -1;
+}
+
+int jitterz_run(struct jitterz *j, int seconds)
+{
+	int n, started;
+
+	if (!j->cpu_states)
+		return fail(j, "Not configured");
+	j->run_time = seconds > 0 ? seconds : 0;
+	j->stop = 0;
+	j->failed = 0;
+	j->breaktrace_hit = 0;
+	j->ready = 0;
+	j->starting = j->config.nr_cpus;
+
+	for (started = 0; started < j->config.nr_cpus; started++) {
+		struct cpu_state *s = &j->cpu_states[started];
+
+		if (pthread_create(&s->thread, NULL, measure, s)) {
+			thread_failed(j, "Error while creating thread", s->cpu);
+			pthread_mutex_lock(&j->start_lock);
+			j->starting = started;
+			pthread_cond_broadcast(&j->start_cond);
+			pthread_mutex_unlock(&j->start_lock);
+			break;
+		}
+	}
+	for (n = 0; n < started; n++)
+		pthread_join(j->cpu_states[n].thread, NULL);
+	if (j->failed)
+		return -1;
+	if (j->config.correlate)
+		return classify_stalls(j);
+	return 0;
+}
+
+void jitterz_stop(struct jitterz *j)
+{
+	__atomic_store_n(&j->stop, 1, __ATOMIC_RELAXED);
+}
+
+int jitterz_snapshot(struct jitterz *j, int n, struct jitterz_snapshot *snap)
+{
+	struct cpu_state *s;
+	int i;
+
+	if (!j->cpu_states || n < 0 || n >= j->config.nr_cpus)
+		return fail(j, "No measured cpu %d", n);
+	s = &j->cpu_states[n];
+	memset(snap, 0, sizeof(*snap));
+	snap->cpu = s->cpu;
+	snap->iterations = s->iterations;
+	snap->duration_s = s->real_duration;
+	if (s->real_duration > 0 && s->iterations) {
+		snap->samples_per_s = s->iterations / s->real_duration;
+		snap->typical_delta_ns = s->real_duration * 1e9 / s->iterations;
+	}
+	if (s->min_delta != UINT64_MAX)
+		snap->min_delta_ns = s->min_delta * 1e9 / s->frequency;
+	if (j->config.fine_ns) {
+		snap->fine_width_ns = (1ULL << s->fine_shift) * 1e9 / s->frequency;
+		memcpy(snap->fine_counts, s->fine, sizeof(snap->fine_counts));
+	}
+	snap->lost_s = (double)s->accumulated_lost_ticks / s->frequency;
+	for (i = 0; i < NUMBER_BUCKETS; i++) {
+		snap->cutoff_ns[i] = s->b[i].time_boundry;
+		snap->counts[i] = s->b[i].count;
+		snap->stalls += s->b[i].count;
+	}
+	if (s->hdr.counts)
+		snap->max_ns = s->hdr.max * 1e9 / s->frequency;
+	snap->local_stalls = s->local_stalls;
+	snap->local_lost_s = (double)s->local_ticks / s->frequency;
+	snap->global_stalls = s->global_stalls;
+	snap->global_lost_s = (double)s->global_ticks / s->frequency;
+	snap->global_events = s->global_events;
+	return 0;
+}
+
+double jitterz_percentile(struct jitterz *j, int n, double percentile)
+{
+	struct cpu_state *s;
+
+	if (!j->cpu_states || n < 0 || n >= j->config.nr_cpus)
+		return 0;
+	s = &j->cpu_states[n];
+	if (!s->hdr.counts)
+		return 0;
+	return jitterz_hdr_percentile(&s->hdr, percentile) * 1e9 /
+	       s->frequency;
+}
+
+static int longer_stall(const void *a, const void *b)
+{
+	const struct stall_record *x = a, *y = b;
+
+	return x->ticks < y->ticks ? 1 : x->ticks > y->ticks ? -1 : 0;
+}
+
+int jitterz_longest_stalls(struct jitterz *j, struct jitterz_stall *stalls,
+			   int max)
+{
+	struct stall_record *all;
+	size_t size = (size_t)j->config.top_stalls * j->config.nr_cpus + 1;
+	int n, i, count = 0;
+
+	if (!j->cpu_states)
+		return fail(j, "Not configured");
+	if ((size_t)j->config.top_stalls > SIZE_MAX / sizeof(*all) /
+						 j->config.nr_cpus ||
+	    size > INT_MAX)
+		return fail(j, "Too many stalls to sort");
+	all = malloc(size * sizeof(*all));
+	if (!all)
+		return fail(j, "Out of memory");
+	for (n = 0; n < j->config.nr_cpus; n++) {
+		struct cpu_state *s = &j->cpu_states[n];
+
+		memcpy(all + count, s->top, s->top_count * sizeof(*all));
+		count += s->top_count;
+	}
+	qsort(all, count, sizeof(*all), longer_stall);
+	if (count > max)
+		count = max;
+	for (i = 0; i < count; i++) {
+		struct cpu_state *s = &j->cpu_states[0];
+
+		for (n = 0; n < j->config.nr_cpus; n++)
+			if (j->cpu_states[n].cpu == all[i].cpu)
+				s = &j->cpu_states[n];
+		stalls[i].cpu = all[i].cpu;
+		stalls[i].realtime_ns =
+			s->realtime_start +
+			(uint64_t)((all[i].start_tick - s->test_tick_start) *
+				   1e9 / s->frequency);
+		stalls[i].ns = all[i].ticks * 1e9 / s->frequency;
+	}
+	free(all);
+	return count;
+}
+
+const struct jitterz_shm *jitterz_shm_open(const char *name)
+{
+	struct jitterz_shm *shm;
+	struct stat st;
+	int fd = shm_open(name, O_RDONLY, 0);
+
+	if (fd < 0)
+		return NULL;
+	if (fstat(fd, &st) || st.st_size < (off_t)sizeof(*shm)) {
+		close(fd);
+		errno = EINVAL;
+		return NULL;
+	}
+	shm = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (shm == MAP_FAILED)
+		return NULL;
+	if (__atomic_load_n(&shm->magic, __ATOMIC_ACQUIRE) !=
+		    JITTERZ_SHM_MAGIC ||
+	    shm->version != JITTERZ_SHM_VERSION || shm->size != st.st_size) {
+		munmap(shm, st.st_size);
+		errno = EINVAL;
+		return NULL;
+	}
+	return shm;
+}
+
+int jitterz_shm_read(const struct jitterz_shm *shm, int n,
+		     struct jitterz_shm_cpu *cpu)
+{
+	const struct jitterz_shm_cpu *c;
+	uint64_t seq;
+	int tries;
+
+	if (n < 0 || n >= shm->nr_cpus) {
+		errno = EINVAL;
+		return -1;
+	}
+	c = &shm->cpus[n];
+	/* a writer that died or was preempted mid update keeps seq odd */
+	for (tries = 0; tries < SHM_READ_TRIES; tries++) {
+		seq = __atomic_load_n(&c->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1)
+			continue;
+		memcpy(cpu, c, sizeof(*cpu));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&c->seq, __ATOMIC_RELAXED) == seq)
+			return 0;
+	}
+	errno = EAGAIN;
+	return -1;
+}
+
+void jitterz_shm_close(const struct jitterz_shm *shm)
+{
+	munmap((void *)shm, shm->size);
+}
+
+const char *jitterz_error(const struct jitterz *j)
+{
+	return j->error;
+}
+
+void jitterz_destroy(struct jitterz *j)
+{
+	if (!j)
+		return;
+	free_cpu_states(j);
+	close_tracefs(j);
+	close_shm(j);
+	pthread_mutex_destroy(&j->start_lock);
+	pthread_cond_destroy(&j->start_cond);
+	free(j);
+}